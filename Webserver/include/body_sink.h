@@ -0,0 +1,71 @@
+//
+// Created by tyz on 23-5-30.
+//
+
+#ifndef WEBSERVER_BODY_SINK_H
+#define WEBSERVER_BODY_SINK_H
+// C++ system headers
+#include <functional>
+#include <memory>
+#include <string>
+// .h files in this project
+#include "body_stream.h"
+
+/**
+ * @brief receiver of the body of a POST or PUT, as it arrives
+ *
+ * http_conn decodes the body (Content-Length or chunked) and hands its bytes
+ * to write() on a thread of the threadpool, or of the ring, never on a
+ * reactor. When splice_fd() is a file, the rest of a Content-Length body
+ * goes there with splice() instead, without being copied to user space.
+ */
+class body_sink{
+public:
+    body_sink() = default;
+    virtual ~body_sink() = default;
+    body_sink(const body_sink&) = delete;
+    body_sink& operator=(const body_sink&) = delete;
+
+    // the next bytes of the body, false fails the request with a 500
+    virtual bool write(const char* data, size_t len) = 0;
+    // a file which may take the rest of the body, -1 if only write() can
+    virtual int splice_fd() const { return -1; }
+    virtual void spliced(size_t /*len*/) {}     // len bytes went to splice_fd()
+    // the whole body has arrived: the response, nullptr for a 500
+    virtual std::unique_ptr<body_stream> finish() = 0;
+};
+
+/**
+ * @brief a body kept in memory up to a threshold, and past it in an unnamed
+ * temporary file, which the rest of the body is spliced to
+ */
+class spool_sink: public body_sink{
+public:
+    // the response to the whole body, in memory() or in file()
+    typedef std::function<std::unique_ptr<body_stream>(spool_sink& body)> handler;
+
+    // config.body_memory_size and config.spool_dir decide where the body goes
+    explicit spool_sink(handler done);
+    ~spool_sink() override;
+
+    bool write(const char* data, size_t len) override;
+    int splice_fd() const override { return fd; }
+    void spliced(size_t len) override { bytes += len; }
+    std::unique_ptr<body_stream> finish() override { return done(*this); }
+
+    size_t size() const { return bytes; }
+    bool in_memory() const { return fd == -1; }
+    const std::string& memory() const { return buf; }
+    int file() const { return fd; }             // -1 while in memory, its offset is at the end
+    int release_file();                         // the caller closes it
+
+private:
+    bool spill();
+
+    handler done;
+    std::string buf;
+    int fd;
+    size_t bytes;
+};
+
+#endif //WEBSERVER_BODY_SINK_H
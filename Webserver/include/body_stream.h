@@ -0,0 +1,107 @@
+//
+// Created by tyz on 23-5-29.
+//
+
+#ifndef WEBSERVER_BODY_STREAM_H
+#define WEBSERVER_BODY_STREAM_H
+// C system headers
+#include <sys/types.h>
+// C++ system headers
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief body of a response produced while it is sent, with
+ * Transfer-Encoding: chunked
+ *
+ * http_conn asks for the next chunk only when the socket has taken the
+ * previous one, so a slow client slows the producer down instead of making
+ * the server buffer the body. read() runs on the thread of the loop owning
+ * the connection and must not block: a source which has nothing yet returns
+ * EAGAIN and the loop waits for wait_fd() to become readable.
+ */
+class body_stream{
+public:
+    explicit body_stream(std::string_view type = "application/octet-stream", int status = 200)
+        : type(type), code(status) {}
+    virtual ~body_stream() = default;
+    body_stream(const body_stream&) = delete;
+    body_stream& operator=(const body_stream&) = delete;
+
+    // up to len bytes of the body at out: how many, 0 at its end, -1 with errno
+    // EAGAIN if wait_fd() has to become readable first, -1 otherwise on errors
+    virtual ssize_t read(char* out, size_t len) = 0;
+    // readable once read() has more, -1 if read() never returns EAGAIN
+    virtual int wait_fd() const { return -1; }
+    std::string_view content_type() const { return type; }
+    int status() const { return code; }         // of the response
+
+private:
+    std::string type;
+    int code;
+};
+
+/**
+ * @brief a body made by a function, called for every chunk
+ */
+class generator_stream: public body_stream{
+public:
+    // fills up to len bytes at out, returns how many, 0 at the end
+    typedef std::function<size_t(char* out, size_t len)> generator;
+
+    generator_stream(generator next, std::string_view type, int status = 200)
+        : body_stream(type, status), next(std::move(next)) {}
+    ssize_t read(char* out, size_t len) override { return static_cast<ssize_t>(next(out, len)); }
+
+private:
+    generator next;
+};
+
+/**
+ * @brief the output of a pipe, until its write end is closed
+ */
+class pipe_stream: public body_stream{
+public:
+    // takes fd, which is made non-blocking; the child pid, if any, is reaped
+    pipe_stream(int fd, std::string_view type, pid_t child = -1);
+    ~pipe_stream() override;
+    // the standard output of argv run in a child process, nullptr if it can't be started
+    static std::unique_ptr<pipe_stream> spawn(const char* const argv[], std::string_view type);
+
+    ssize_t read(char* out, size_t len) override;
+    int wait_fd() const override { return fd; }
+
+private:
+    int fd;
+    pid_t child;
+};
+
+/**
+ * @brief a file followed while it grows, like tail -f
+ *
+ * What the file has is sent, then what is appended to it, found through an
+ * inotify watch of its own. The body ends when a writer closes the file, or
+ * when the file is removed or renamed.
+ */
+class file_stream: public body_stream{
+public:
+    ~file_stream() override;
+    // nullptr if path can't be opened and watched
+    static std::unique_ptr<file_stream> follow(const char* path, std::string_view type);
+
+    ssize_t read(char* out, size_t len) override;
+    int wait_fd() const override { return notifyfd; }
+
+private:
+    file_stream(int fd, int notifyfd, std::string_view type);
+    bool drain_events();                // whether inotify had events, clears writing
+
+    int fd;
+    int notifyfd;
+    off_t offset;                       // next byte to send
+    bool writing;                       // the file may still grow
+};
+
+#endif //WEBSERVER_BODY_STREAM_H
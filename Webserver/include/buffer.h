@@ -0,0 +1,41 @@
+//
+// Created by tyz on 23-5-23.
+//
+
+#ifndef WEBSERVER_BUFFER_H
+#define WEBSERVER_BUFFER_H
+// C++ system headers
+#include <cstddef>
+
+/**
+ * @brief contiguous byte buffer whose storage is a chunk of the per-thread pool
+ *
+ * Chunks are powers of two from MIN_CHUNK to MAX_CHUNK. reserve() moves the
+ * content to a bigger chunk, so the owner has to rebase pointers into it.
+ * release() gives the chunk back to the pool of the calling thread.
+ */
+class buffer{
+public:
+    static constexpr size_t MIN_CHUNK = 4096;
+    static constexpr size_t MAX_CHUNK = 1 << 20;
+
+    buffer() = default;
+    ~buffer();
+    buffer(const buffer&) = delete;
+    buffer& operator=(const buffer&) = delete;
+
+    char* data() { return chunk; }
+    const char* data() const { return chunk; }
+    char& operator[](size_t i) { return chunk[i]; }
+    size_t capacity() const { return size; }
+
+    // at least n bytes, keeping the first used ones; false past MAX_CHUNK
+    bool reserve(size_t n, size_t used);
+    void release();
+
+private:
+    char* chunk = nullptr;
+    size_t size = 0;
+};
+
+#endif //WEBSERVER_BUFFER_H
@@ -0,0 +1,141 @@
+//
+// Created by tyz on 23-5-30.
+//
+
+#ifndef WEBSERVER_CHUNKED_DECODER_H
+#define WEBSERVER_CHUNKED_DECODER_H
+// C++ system headers
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief decoder of a request body sent with Transfer-Encoding: chunked
+ *
+ * It keeps its state between calls, so the body may arrive in any pieces:
+ * every byte given is consumed, up to the end of the body. The data of the
+ * chunks is handed out where it is, chunk extensions and trailers are
+ * skipped.
+ */
+class chunked_decoder{
+public:
+    enum RESULT{CHUNKED_MORE=0, CHUNKED_DONE, CHUNKED_BAD};
+
+    chunked_decoder() { reset(); }
+    void reset() {
+        state = SIZE;
+        size = 0;
+        digits = 0;
+    }
+    // data(const char*, size_t) gets the bytes of the chunks in [p, p + len),
+    // returning false stops with CHUNKED_BAD. used: bytes consumed
+    template<typename F>
+    RESULT decode(const char* p, size_t len, size_t& used, F&& data) {
+        const char* const begin = p;
+        const char* const end = p + len;
+        while (p < end) {
+            char c = *p;
+            switch (state) {
+                case SIZE: {
+                    int value = hex_value(c);
+                    if (value >= 0) {
+                        if (++digits > 15)                      // more than 2^60 bytes
+                            return bad(p, begin, used);
+                        size = size << 4 | static_cast<uint64_t>(value);
+                    } else if (digits == 0) {
+                        return bad(p, begin, used);
+                    } else if (c == ';' || c == ' ' || c == '\t') {
+                        state = EXTENSION;
+                    } else if (c == '\r') {
+                        state = SIZE_LF;
+                    } else {
+                        return bad(p, begin, used);
+                    }
+                    ++p;
+                    break;
+                }
+                case EXTENSION:
+                    if (c == '\r')
+                        state = SIZE_LF;
+                    ++p;
+                    break;
+                case SIZE_LF:
+                    if (c != '\n')
+                        return bad(p, begin, used);
+                    state = size ? DATA : TRAILER;
+                    ++p;
+                    break;
+                case DATA: {
+                    size_t n = static_cast<size_t>(std::min<uint64_t>(size, end - p));
+                    if (!data(p, n))
+                        return bad(p, begin, used);
+                    p += n;
+                    size -= n;
+                    if (size == 0)
+                        state = DATA_CR;
+                    break;
+                }
+                case DATA_CR:
+                case TRAILER_CR:
+                    if (c != '\r')
+                        return bad(p, begin, used);
+                    state = state == DATA_CR ? DATA_LF : END_LF;
+                    ++p;
+                    break;
+                case DATA_LF:
+                    if (c != '\n')
+                        return bad(p, begin, used);
+                    state = SIZE;
+                    digits = 0;
+                    ++p;
+                    break;
+                case TRAILER:
+                    // an empty line ends the trailers
+                    state = c == '\r' ? TRAILER_CR : TRAILER_FIELD;
+                    break;
+                case TRAILER_FIELD:
+                    if (c == '\r')
+                        state = TRAILER_LF;
+                    ++p;
+                    break;
+                case TRAILER_LF:
+                    if (c != '\n')
+                        return bad(p, begin, used);
+                    state = TRAILER;
+                    ++p;
+                    break;
+                case END_LF:
+                    if (c != '\n')
+                        return bad(p, begin, used);
+                    used = ++p - begin;
+                    reset();
+                    return CHUNKED_DONE;
+            }
+        }
+        used = p - begin;
+        return CHUNKED_MORE;
+    }
+
+private:
+    enum STATE{SIZE=0, EXTENSION, SIZE_LF, DATA, DATA_CR, DATA_LF,
+            TRAILER, TRAILER_FIELD, TRAILER_LF, TRAILER_CR, END_LF};
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        c |= 0x20;
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        return -1;
+    }
+    static RESULT bad(const char* p, const char* begin, size_t& used) {
+        used = p - begin;
+        return CHUNKED_BAD;
+    }
+
+    STATE state;
+    uint64_t size;                      // of the chunk, what is left of it in DATA
+    int digits;                         // of its size so far
+};
+
+#endif //WEBSERVER_CHUNKED_DECODER_H
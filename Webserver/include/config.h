@@ -0,0 +1,40 @@
+//
+// Created by tyz on 23-5-20.
+//
+
+#ifndef WEBSERVER_CONFIG_H
+#define WEBSERVER_CONFIG_H
+// C++ system headers
+#include <cstddef>
+
+enum DISPATCH_MODE{DISPATCH_ROUND_ROBIN=0, DISPATCH_LEAST_LOAD};
+enum IO_BACKEND{IO_EPOLL=0, IO_URING};
+enum SEND_MODE{SEND_MMAP=0, SEND_SENDFILE};
+enum QUEUE_MODE{QUEUE_STEALING=0, QUEUE_LOCKFREE, QUEUE_MUTEX};
+enum TIMER_MODE{TIMER_ALARM=0, TIMER_FD};
+
+// options of the server, filled by main() before any thread starts
+struct server_config{
+    int reactors = 0;                           // 0: everything runs in the main loop
+    DISPATCH_MODE dispatch = DISPATCH_ROUND_ROBIN;
+    int backlog = 5;                            // backlog of listen()
+    bool reuseport = false;                     // every sub-reactor listens on its own socket
+    bool cpu_steering = false;                  // reuseport CBPF: pick the socket of the current cpu
+    IO_BACKEND backend = IO_EPOLL;
+    SEND_MODE send_mode = SEND_MMAP;            // how the body of a file is sent
+    size_t file_cache_size = 64 << 20;          // bytes of files kept open, 0 disables the cache
+    size_t small_file_size = 16 << 10;          // files up to it keep their whole responses
+    size_t response_cache_size = 16 << 20;      // bytes of those responses
+    size_t encoded_cache_size = 16 << 20;       // bytes of compressed files, 0: only precompressed siblings
+    size_t max_header_size = 64 << 10;          // largest request head, and response head
+    QUEUE_MODE queue = QUEUE_STEALING;          // work queue of the threadpool
+    TIMER_MODE timer = TIMER_ALARM;             // SIGALRM, or a timerfd per loop and a signalfd
+    bool examples = false;                      // the body_stream endpoints under /stream/
+    size_t max_body_size = 64 << 20;            // largest request body, decoded
+    size_t body_memory_size = 256 << 10;        // a spool_sink keeps up to it in memory
+    const char* spool_dir = "/tmp";             // where a spool_sink puts larger bodies
+};
+
+inline server_config config;
+
+#endif //WEBSERVER_CONFIG_H
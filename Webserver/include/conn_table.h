@@ -0,0 +1,56 @@
+//
+// Created by tyz on 23-5-23.
+//
+
+#ifndef WEBSERVER_CONN_TABLE_H
+#define WEBSERVER_CONN_TABLE_H
+// C++ system headers
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+// .h files in this project
+#include "http_conn.h"
+
+const int MAX_FD = 65536;
+
+/**
+ * @brief fd -> http_conn map of every backend, replacing new http_conn[MAX_FD]
+ *
+ * The table is split into pages of PAGE_SIZE slots which are allocated the
+ * first time an fd of theirs connects, and the http_conn objects come from a
+ * pool which grows by slabs of SLAB_SIZE on accept and takes them back on
+ * close. Memory thus follows the number of live connections instead of
+ * MAX_FD. Objects are never freed before exit, so a pointer to a closed
+ * connection held by a timer or a queued task stays valid.
+ */
+class conn_table{
+public:
+    static const int PAGE_SIZE = 1024;
+    static const int PAGE_COUNT = MAX_FD / PAGE_SIZE;
+    static const int SLAB_SIZE = 64;
+
+    static conn_table* Getinstance();
+    conn_table(const conn_table&) = delete;
+    conn_table& operator=(const conn_table&) = delete;
+
+    http_conn* get(int fd) const;       // nullptr if fd isn't connected
+    http_conn* acquire(int fd);         // take a pooled http_conn and bind it to fd
+    void unbind(int fd);                // before fd is closed, the number may be reused at once
+    void recycle(http_conn* conn);      // after the connection has been closed
+
+private:
+    struct page{
+        std::atomic<http_conn*> slots[PAGE_SIZE];
+    };
+
+    conn_table();
+    ~conn_table();
+
+    std::atomic<page*> pages[PAGE_COUNT];
+    std::mutex locker;                  // protects free_conns and slabs
+    std::vector<http_conn*> free_conns;
+    std::vector<std::unique_ptr<http_conn[]>> slabs;
+};
+
+#endif //WEBSERVER_CONN_TABLE_H
@@ -0,0 +1,38 @@
+//
+// Created by tyz on 23-5-28.
+//
+
+#ifndef WEBSERVER_CONTENT_ENCODING_H
+#define WEBSERVER_CONTENT_ENCODING_H
+// C++ system headers
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief the content codings of the server: their names, what a client
+ * accepts of them, and the compressors built in
+ *
+ * gzip (zlib) is always built in, brotli and zstd when their libraries are
+ * found (WEBSERVER_BROTLI, WEBSERVER_ZSTD). Any of them may be sent from a
+ * precompressed sibling of the file, "index.html.br" for "index.html".
+ */
+class content_encoding{
+public:
+    enum CODING{CODING_IDENTITY=0, CODING_GZIP, CODING_BR, CODING_ZSTD, CODING_COUNT};
+    static const size_t MIN_COMPRESS = 256;         // smaller files aren't worth a Content-Encoding
+    static const size_t MAX_COMPRESS = 1 << 20;     // larger ones are only sent precompressed
+    static const CODING preference[3];              // of the server, best first
+
+    static const char* name(CODING coding);         // token of Content-Encoding
+    static const char* suffix(CODING coding);       // of the sibling file
+    static bool can_compress(CODING coding);
+    // bit c set if the client takes coding c (q > 0)
+    static unsigned accepted(std::string_view accept_encoding);
+    static bool compressible(std::string_view content_type);
+    // nullptr if it fails or saves less than 1/8
+    static std::shared_ptr<const std::string> compress(CODING coding, const char* data, size_t len);
+};
+
+#endif //WEBSERVER_CONTENT_ENCODING_H
@@ -0,0 +1,38 @@
+//
+// Created by tyz on 23-5-31.
+//
+
+#ifndef WEBSERVER_EVENT_LOOP_H
+#define WEBSERVER_EVENT_LOOP_H
+// C++ system headers
+#include <cstdint>
+
+class http_conn;
+
+/**
+ * @brief what http_conn needs from the loop owning it: a reactor, or a
+ * uring_loop
+ *
+ * A handler suspended by an awaitable of request waits on the loop for one
+ * thing at a time, described by http_conn::wait. The loop stores the result
+ * there and calls wake(), which resumes the handler on its own thread. These
+ * are called on that thread only.
+ */
+class event_loop{
+public:
+    virtual ~event_loop() = default;
+
+    virtual int get_epollfd() const { return -1; }          // -1 if the loop doesn't use epoll
+    virtual void conn_closed() {}
+    // the socket of conn is writable, or what its handler waits for has happened
+    virtual void wake(http_conn* conn) = 0;
+
+    // these return false if the wait is over already, and set wait.result
+    virtual bool watch(http_conn* conn, int fd, uint32_t events) = 0;  // EPOLLIN or EPOLLOUT of fd
+    virtual bool sleep(http_conn* conn, int ms) = 0;
+    virtual bool read_file(http_conn* conn) = 0;            // wait.read_fd, buf, len and offset
+    // conn is closing: cancel what it waits for
+    virtual void forget(http_conn* conn) = 0;
+};
+
+#endif //WEBSERVER_EVENT_LOOP_H
@@ -0,0 +1,57 @@
+//
+// Created by tyz on 23-5-24.
+//
+
+#ifndef WEBSERVER_EVENTCOUNT_H
+#define WEBSERVER_EVENTCOUNT_H
+// C system headers
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+// C++ system headers
+#include <atomic>
+#include <climits>
+#include <cstdint>
+
+/**
+ * @brief lets consumers of a lock-free queue sleep on a futex
+ *
+ * A consumer which finds the queue empty calls prepare_wait(), checks the
+ * queue once more and then either cancel_wait() or wait(key). A producer
+ * calls notify_one() after its push, which costs one load when nobody
+ * sleeps. A push between prepare_wait() and wait() bumps the epoch, so the
+ * futex returns at once and the wakeup is not lost.
+ */
+class eventcount{
+public:
+    uint32_t prepare_wait() {
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        return epoch.load(std::memory_order_seq_cst);
+    }
+    void cancel_wait() {
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+    void wait(uint32_t key) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAIT_PRIVATE, key,
+                nullptr, nullptr, 0);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+    void notify_one() { notify(1); }
+    void notify_all() { notify(INT_MAX); }
+
+private:
+    void notify(int count) {
+        // orders the push of the caller before the load of waiters
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) == 0)
+            return;
+        epoch.fetch_add(1, std::memory_order_seq_cst);
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAKE_PRIVATE, count,
+                nullptr, nullptr, 0);
+    }
+
+    std::atomic<uint32_t> epoch{0};
+    std::atomic<int> waiters{0};
+};
+
+#endif //WEBSERVER_EVENTCOUNT_H
@@ -0,0 +1,91 @@
+//
+// Created by tyz on 23-5-22.
+//
+
+#ifndef WEBSERVER_FILE_CACHE_H
+#define WEBSERVER_FILE_CACHE_H
+// C system headers
+#include <sys/stat.h>
+// C++ system headers
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+// .h files in this project
+#include "content_encoding.h"
+
+/**
+ * @brief an opened (and mapped) file shared by every response which sends it
+ */
+struct cached_file{
+    std::string path;
+    int fd;
+    struct stat file_stat;
+    char* address;                      // nullptr if the file is empty or not mapped
+    unsigned siblings;                  // bit c: the file has a sibling compressed with coding c
+    // compressed by the server, and codings which didn't save enough
+    std::shared_ptr<const std::string> encoded[content_encoding::CODING_COUNT];
+    unsigned incompressible;
+    // whole serialized responses of a small file, by coding and keep-alive flag
+    std::shared_ptr<const std::string> responses[content_encoding::CODING_COUNT][2];
+    ~cached_file();
+};
+
+/**
+ * @brief LRU cache of the files under doc_root, keyed by their path with
+ * the empty and "." segments folded (see do_request), symlinks unresolved
+ *
+ * A hit costs no syscall. The cache drops its reference when a file is
+ * evicted or changes on disk (inotify on the directory of every cached
+ * file), and the fd and mapping are released with the last response
+ * still using them.
+ *
+ * Small files also keep their complete responses (status line, headers and
+ * body in one buffer), and text files their compressed variants, each
+ * bounded by a budget of their own and dropped along with the file. A
+ * change to a sibling ("index.html.gz") drops the file too.
+ */
+class file_cache{
+public:
+    static file_cache* Getinstance();
+    file_cache(const file_cache&) = delete;
+    file_cache& operator=(const file_cache&) = delete;
+
+    std::shared_ptr<cached_file> lookup(const char* path);
+    std::shared_ptr<const std::string> lookup_response(const std::shared_ptr<cached_file>& file,
+                                                       content_encoding::CODING coding, bool linger);
+    void keep_response(const std::shared_ptr<cached_file>& file, content_encoding::CODING coding,
+                       bool linger, std::shared_ptr<const std::string> response);
+    // the file compressed with coding, done on the first call; nullptr if not worth it
+    std::shared_ptr<const std::string> encode(const std::shared_ptr<cached_file>& file,
+                                              content_encoding::CODING coding);
+    // takes fd on success, returns nullptr if the file doesn't fit
+    std::shared_ptr<cached_file> insert(const char* path, int fd, const struct stat& st);
+    void invalidate(const std::string& path);
+    void clear();
+
+    int get_notifyfd() const { return notifyfd; }
+    void handle_events();                // drain the inotify fd
+
+private:
+    file_cache();
+    ~file_cache();
+    void watch(const std::string& path);
+    void erase(std::list<std::shared_ptr<cached_file>>::iterator it);
+
+    std::mutex locker;
+    std::list<std::shared_ptr<cached_file>> lru;        // most recently used first
+    std::unordered_map<std::string, std::list<std::shared_ptr<cached_file>>::iterator> files;
+    size_t bytes;
+    size_t budget;
+    size_t response_bytes;
+    size_t response_budget;
+    size_t encoded_bytes;
+    size_t encoded_budget;
+    int notifyfd;
+    std::unordered_map<std::string, int> dir_wds;       // watched directory -> wd
+    std::unordered_map<int, std::string> wd_dirs;
+};
+
+#endif //WEBSERVER_FILE_CACHE_H
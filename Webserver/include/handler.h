@@ -0,0 +1,102 @@
+//
+// Created by tyz on 23-5-31.
+//
+
+#ifndef WEBSERVER_HANDLER_H
+#define WEBSERVER_HANDLER_H
+// C system headers
+#include <sys/types.h>
+// C++ system headers
+#include <coroutine>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+// .h files in this project
+#include "body_stream.h"
+#include "http_parser.h"
+#include "route_trie.h"
+#include "task.h"
+
+class http_conn;
+
+/**
+ * @brief what a coroutine handler answers
+ */
+struct response{
+    int status = 200;                   // one header_writer has a status line for, else a 500 is sent
+    std::string content_type = "text/plain";
+    std::string body;                   // sent with a Content-Length
+    std::unique_ptr<body_stream> stream;    // sent chunked instead of body, if set
+};
+
+/**
+ * @brief the request given to a coroutine handler, and the waits it may
+ * co_await
+ *
+ * The head is copied out of read_buf, which moves on to the pipelined
+ * requests while the handler runs. The handler runs on the thread of the
+ * loop owning the connection, never on the threadpool, and gives the thread
+ * back at every co_await of a wait: the loop resumes it when the wait is
+ * over. Waits are one at a time, the handler may co_await nothing else than
+ * them and other tasks.
+ */
+class request{
+public:
+    /**
+     * @brief co_await gives what the wait gave, -errno on errors
+     */
+    class awaiter{
+    public:
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> waiter);
+        ssize_t await_resume() const;
+
+    private:
+        friend class request;
+        enum KIND{WATCH=0, SLEEP, READ};
+        awaiter(http_conn& conn, KIND kind, int fd, uint32_t events = 0)
+            : conn(conn), kind(kind), fd(fd), events(events), buf(nullptr), len(0), offset(0) {}
+
+        http_conn& conn;
+        KIND kind;
+        int fd;                         // ms for SLEEP
+        uint32_t events;
+        char* buf;
+        size_t len;
+        off_t offset;
+    };
+
+    // route: of url, whose query find_route() cut off
+    request(http_conn& conn, const char* base, const http_parser& parser, const char* url, const route_trie::match& route);
+    request(const request&) = delete;
+    request& operator=(const request&) = delete;
+
+    std::string_view method() const { return http_parser::view(head.data(), parser.method); }
+    std::string_view url() const { return std::string_view(head.data() + url_offset, url_length); }    // with the query
+    std::string_view path() const { return url().substr(0, path_length); }
+    std::string_view rest() const { return path().substr(route.rest); }    // the path after what the pattern matched
+    // the segment of the url matching ":name" in the pattern, data() is nullptr if it has none
+    std::string_view param(std::string_view name) const;
+    // data() is nullptr if the request has no such header
+    std::string_view header(http_parser::HEADER name) const;
+    std::string_view header(std::string_view name) const;
+
+    awaiter readable(int fd);           // the poll events of fd, once it has EPOLLIN
+    awaiter writable(int fd);           // once it has EPOLLOUT
+    // 0 after ms, within a TIMESLOT if the main loop is ticked by alarm()
+    awaiter sleep(int ms);
+    // pread() of a regular file without blocking the loop, the bytes read
+    awaiter read(int fd, char* buf, size_t len, off_t offset);
+
+private:
+    http_conn& conn;
+    std::string head;
+    http_parser parser;                 // of head
+    size_t url_offset;
+    size_t url_length;
+    size_t path_length;                 // of url, before the query
+    route_trie::match route;
+};
+
+#endif //WEBSERVER_HANDLER_H
@@ -0,0 +1,145 @@
+//
+// Created by tyz on 23-5-27.
+//
+
+#ifndef WEBSERVER_HEADER_WRITER_H
+#define WEBSERVER_HEADER_WRITER_H
+// C++ system headers
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+// .h files in this project
+#include "http_date.h"
+
+/**
+ * @brief writer of a response head into memory reserved beforehand
+ *
+ * The status lines and the header names are literals copied with memcpy,
+ * numbers are formatted two digits at a time: nothing is parsed as with
+ * the printf family. The appends don't check the room left, the caller
+ * reserves MAX_HEAD bytes, more than any head http_conn builds.
+ */
+class header_writer{
+public:
+    static const size_t MAX_HEAD = 512;
+
+    static constexpr std::string_view SERVER = "Server: Webserver\r\n";
+    static constexpr std::string_view CONTENT_TYPE = "Content-Type: ";
+    static constexpr std::string_view CONTENT_LENGTH = "Content-Length: ";
+    static constexpr std::string_view ETAG = "ETag: ";
+    static constexpr std::string_view LAST_MODIFIED = "Last-Modified: ";
+    static constexpr std::string_view CONTENT_ENCODING = "Content-Encoding: ";
+    static constexpr std::string_view VARY = "Vary: Accept-Encoding\r\n";
+    static constexpr std::string_view ACCEPT_RANGES = "Accept-Ranges: bytes\r\n";
+    static constexpr std::string_view CONTENT_RANGE = "Content-Range: bytes ";
+    static constexpr std::string_view CHUNKED = "Transfer-Encoding: chunked\r\n";
+    static constexpr std::string_view LAST_CHUNK = "0\r\n\r\n";
+    static constexpr std::string_view KEEP_ALIVE = "Connection: keep-alive\r\n";
+    static constexpr std::string_view CLOSE = "Connection: close\r\n";
+    static constexpr std::string_view CRLF = "\r\n";
+
+    // "HTTP/1.1 <status> <title>\r\n" of the statuses the server sends
+    static std::string_view status_line(int status) {
+        switch (status) {
+            case 200: return "HTTP/1.1 200 OK\r\n";
+            case 201: return "HTTP/1.1 201 Created\r\n";
+            case 206: return "HTTP/1.1 206 Partial Content\r\n";
+            case 304: return "HTTP/1.1 304 Not Modified\r\n";
+            case 400: return "HTTP/1.1 400 BAD_REQUEST\r\n";
+            case 403: return "HTTP/1.1 403 Forbidden\r\n";
+            case 404: return "HTTP/1.1 404 Not Found\r\n";
+            case 405: return "HTTP/1.1 405 Method Not Allowed\r\n";
+            case 413: return "HTTP/1.1 413 Content Too Large\r\n";
+            case 416: return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+            default: return "HTTP/1.1 500 Internal Errno\r\n";
+        }
+    }
+
+    explicit header_writer(char* out): begin(out), pos(out) {}
+
+    header_writer& append(std::string_view text) {
+        memcpy(pos, text.data(), text.size());
+        pos += text.size();
+        return *this;
+    }
+    header_writer& status(int status) { return append(status_line(status)); }
+    header_writer& date() {
+        http_date::copy(pos);
+        pos += http_date::LEN;
+        return *this;
+    }
+    // the Date and Server lines every response has, right after the status line
+    header_writer& general() { return date().append(SERVER); }
+    // name: one of the constants above, with its ": "
+    header_writer& field(std::string_view name, std::string_view value) {
+        return append(name).append(value).append(CRLF);
+    }
+    header_writer& field(std::string_view name, uint64_t value) {
+        return append(name).number(value).append(CRLF);
+    }
+    header_writer& field_date(std::string_view name, time_t date) {
+        append(name);
+        http_date::format(pos, date);
+        pos += http_date::DATE_LEN;
+        return append(CRLF);
+    }
+    // "Content-Range: bytes first-last/size"
+    header_writer& content_range(uint64_t first, uint64_t last, uint64_t size) {
+        return append(CONTENT_RANGE).number(first).append("-").number(last).append("/").number(size).append(CRLF);
+    }
+    header_writer& connection(bool keep_alive) { return append(keep_alive ? KEEP_ALIVE : CLOSE); }
+    header_writer& end() { return append(CRLF); }
+
+    header_writer& number(uint64_t n) {
+        pos += format_number(pos, n);
+        return *this;
+    }
+    header_writer& hex(uint64_t n) {
+        char digits[16];
+        char* p = digits + sizeof(digits);
+        do {
+            *--p = "0123456789abcdef"[n & 0xf];
+            n >>= 4;
+        } while (n);
+        return append(std::string_view(p, digits + sizeof(digits) - p));
+    }
+    size_t size() const { return pos - begin; }
+
+    static size_t number_length(uint64_t n) {
+        size_t len = 1;
+        for (; n >= 10; n /= 10)
+            ++len;
+        return len;
+    }
+    // the decimal digits of n at out, returns how many
+    static size_t format_number(char* out, uint64_t n) {
+        static const char pairs[] =
+                "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                "8081828384858687888990919293949596979899";
+        char digits[20];
+        char* p = digits + sizeof(digits);
+        while (n >= 100) {
+            const char* pair = pairs + (n % 100) * 2;
+            n /= 100;
+            *--p = pair[1];
+            *--p = pair[0];
+        }
+        if (n >= 10) {
+            *--p = pairs[n * 2 + 1];
+            *--p = pairs[n * 2];
+        } else {
+            *--p = static_cast<char>('0' + n);
+        }
+        size_t len = digits + sizeof(digits) - p;
+        memcpy(out, p, len);
+        return len;
+    }
+
+private:
+    char* begin;
+    char* pos;
+};
+
+#endif //WEBSERVER_HEADER_WRITER_H
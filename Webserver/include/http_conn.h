@@ -10,6 +10,7 @@
 #include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
@@ -20,194 +21,259 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <cstdarg>
 #include <csignal>
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <string_view>
+// .h files in this project
+#include "body_sink.h"
+#include "body_stream.h"
+#include "buffer.h"
+#include "chunked_decoder.h"
+#include "content_encoding.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "handler.h"
+#include "header_writer.h"
+#include "http_parser.h"
+#include "route_trie.h"
+#include "time_wheel.h"
 
-class tw_timer;
 class http_conn{
 public:
     static const int FILENAME_LEN = 200;    //maxlen of the filename
-    static const int READ_BUFFER_SIZE = 2048;
-    static const int WRITE_BUFFER_SIZE = 1024;
-    enum METHOD{GET=0, POST, HEAD, PUT,		//only support GET METHOD
+    static const int MAX_PIPELINE = 16;     // most responses sent by one writev
+    static const int MAX_RANGES = 8;        // most parts of a multipart/byteranges response
+    static const int ETAG_LEN = 64;         // more than the quotes, 3 numbers in hex and 2 '-'
+    static const size_t STREAM_CHUNK = 16 << 10;    // buffer of a chunk of a body_stream
+    static const size_t CHUNK_HEAD = 10;    // room for the size of a chunk, in hex, and its CRLF
+    static const size_t SPLICE_CHUNK = 64 << 10;    // a pipe holds that much by default
+    // in the epoll_event of the wait_fd() of a body_stream, or of a fd a handler
+    // watches, with the sockfd below it
+    static const uint64_t STREAM_EVENT = uint64_t(1) << 32;
+    enum METHOD{GET=0, POST, HEAD, PUT,		//only support GET, POST and PUT
             DELETE, TRACK, OPTIONS, CONNECT, PATCH};
     enum CHECK_STATE{CHECK_STATE_REQUESTLINE=0,
             CHECK_STATE_HEADER,
             CHECK_STATE_CONTENT};
     enum HTTP_CODE{NO_REQUEST, GET_REQUEST, BAD_REQUEST,
                     NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST,
-                    INTERNAL_ERROR, CLOSED_CONNECTION};
-    enum LINE_STATUS{LINE_OK=0, LINE_BAD, LINE_OPEN};
+                    INTERNAL_ERROR, CLOSED_CONNECTION, CACHED_REQUEST,
+                    NOT_MODIFIED, RANGE_NOT_SATISFIABLE, STREAM_REQUEST,
+                    METHOD_NOT_ALLOWED, BODY_TOO_LARGE, HANDLER_REQUEST};
+    enum CHUNK{CHUNK_READY=0,           // iv holds the next chunk of the body_stream, or the response of the handler
+            CHUNK_WAIT,                 // nothing until the wait_fd() of the body_stream is readable,
+                                        // or until the loop wakes the suspended handler up
+            CHUNK_DONE,                 // the last chunk has been sent
+            CHUNK_ERROR};
+    // the body_stream answering a GET of a url matching the pattern it was added
+    // with, rest is the url after what the pattern matched. nullptr for a 404
+    typedef std::function<std::unique_ptr<body_stream>(const http_conn& conn, const char* rest)> stream_handler;
+    // the body_sink taking the body of a POST or PUT of a url matching its pattern. nullptr for a 404
+    typedef std::function<std::unique_ptr<body_sink>(const http_conn& conn, const char* rest)> upload_handler;
+    // the coroutine answering a GET of a url matching its pattern, see request
+    typedef std::function<task<::response>(request& req)> coroutine_handler;
     int sockfd;
     sockaddr_in clnt_adr;
-    tw_timer* timer;
+    tw_timer timer;                     // in the wheel of the owning loop
+    // reads only stamp the time, the timer checks it when it expires
+    void touch(uint64_t now, int timeout) { last_active = now; idle_timeout = timeout; }
+    int remaining(uint64_t now) const {
+        uint64_t deadline = last_active + idle_timeout;
+        return deadline > now ? static_cast<int>(deadline - now) : 0;
+    }
+    std::atomic<int> tasks{0};          // queued in or run by the threadpool
+
+    // what the suspended handler waits for, filled by request::awaiter and the loop
+    struct suspension{
+        std::coroutine_handle<> waiter; // resumed by the next wake(), nullptr if none
+        ssize_t result;                 // given by the co_await
+        int fd = -1;                    // watched, -1 if none
+        tw_timer timer;                 // of a sleep, in the wheel of the owning loop
+        // a read, left to the threadpool by the epoll backend while read_fd isn't -1
+        int read_fd = -1;
+        char* buf;
+        size_t len;
+        off_t offset;
+    };
+    suspension wait;
 
 public:
     [[maybe_unused]] http_conn() = default;
     [[maybe_unused]] ~http_conn() = default;
 
-    void init(int sockfd, const sockaddr_in& addr, tw_timer*);
+    void init(int sockfd, const sockaddr_in& addr, event_loop* loop);
     void close_conn(bool real_close = true);
     void process();
     bool read();
     bool write();
+    // requests were left in read_buf when the batch was built, process() again
+    // once it is out
+    bool has_more() const { return batch_full && bytes_to_send == 0 && !stream && !handler; }
+    bool streaming() const { return stream != nullptr; }
+    bool in_handler() const { return static_cast<bool>(handler); }
+    event_loop* get_loop() const { return owner; }
+    // before the loops start: patterns of route_trie, a url matching none is a
+    // file of doc_root
+    static void add_stream(const char* pattern, stream_handler handler);
+    static void add_upload(const char* pattern, upload_handler handler);
+    static void add_handler(const char* pattern, coroutine_handler handler);
+    static void add_static(const char* prefix, const char* dir);    // files of dir under prefix
+    // a parameter of the route of path, data() is nullptr if it has none
+    static std::string_view find_param(const route_trie::match& route, std::string_view path, std::string_view name);
+    std::string_view get_param(std::string_view name) const;        // of the request being answered
+    METHOD get_method() const { return method; }
+    // headers of the request being answered, views of read_buf valid until the
+    // next one is parsed. data() is nullptr if the request has no such header
+    std::string_view get_header(http_parser::HEADER name) const;
+    std::string_view get_header(std::string_view name) const;
+
+    // used by backends which do the I/O themselves instead of read()/write()
+    bool fill(const char* data, int len);
+    size_t buffered() const { return read_idx; }                  // bytes held by read_buf
+    HTTP_CODE prepare();
+    iovec* get_iov() { return iv + iv_start; }
+    int get_iov_count() const { return iv_count - iv_start; }
+    bool advance(size_t bytes_sent);
+    CHUNK next_chunk();                 // after the batch, and after every chunk or wake of the handler
+    int stream_fd() const { return stream->wait_fd(); }
+    bool finish();
 
 private:
     void init();
     HTTP_CODE process_read();
     bool process_write(HTTP_CODE ret);
+    void next_request();
+    void compact();
+    void queue_reply(const char* body, size_t body_len);
+    void queue_part(size_t head_begin, const char* body, size_t body_len);
+    void gather();
+    void append_iov(const char* data, size_t len);
+    void drop_replies();
+    void wait_stream();
+    CHUNK run_handler();
+    bool add_response(::response& res);
+    void end_handler();
 
-    HTTP_CODE parse_request_line(char* text);
-    HTTP_CODE parse_headers(char* text);
-    HTTP_CODE parse_content(char* text);
+    HTTP_CODE parse_request_line();
+    void parse_headers();
+    HTTP_CODE start_body();
+    HTTP_CODE read_body();
+    bool consume_body(const char* data, size_t len);
+    bool splice_body();
+    HTTP_CODE finish_upload();
+    void end_body();
     HTTP_CODE do_request();
-    char* get_line(){
-        return read_buf + start_line;
-    }
-    LINE_STATUS parse_line();
+    int find_route();
+    HTTP_CODE start_handler(const coroutine_handler& start);
+    HTTP_CODE find_upload();
+    HTTP_CODE find_file(const char* path);
+    content_encoding::CODING negotiate();
+    HTTP_CODE open_file(const char* path);
+    HTTP_CODE use_file();
+    void keep_response();
+    bool grow_read_buf(size_t limit);
 
     // functions for responding HTTP
     void unmap();
-    bool add_response(const char* format, ...);
-    bool add_content(const char* content);
-    bool add_status_line(int status, const char* title);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
-    bool add_linger();
-    bool add_blank_line();
+    char* head_room(size_t extra);
+    bool add_error(int status, const char* form, std::string_view fields = std::string_view());
+    std::string_view content_type() const;
+    size_t format_etag(char* out) const;
+    void add_validators(header_writer& head) const;
+    bool is_conditional() const;
+    bool not_modified() const;
+    bool parse_ranges();
+    bool if_range() const;
+    bool add_range();
+    bool add_multipart();
 
 public:
-    static int epollfd;
-    static int user_count;
+    static std::atomic<int> user_count;
 
 private:
-    char read_buf[READ_BUFFER_SIZE];    // buffer of reading
+    int epollfd;                        // epollfd of the owning reactor, -1 with io_uring
+    event_loop* owner;
+    uint64_t last_active;               // ms of time_wheel::clock()
+    int idle_timeout;                   // ms allowed after last_active
+    buffer read_buf;                    // grows up to config.max_header_size, empty when idle
     int read_idx;                       // next to read
-    int check_idx;                      // deal with it now
-    int start_line;
-    char write_buf[WRITE_BUFFER_SIZE];
+    int check_idx;                      // end of the head, then of the content
+    http_parser parser;                 // of the head at request_start
+    int request_start;                  // first byte of the request being parsed
+    buffer write_buf;                   // status lines and headers of the whole batch
     int write_idx;
+    int head_idx;                       // start of the response being built in write_buf
 
     CHECK_STATE check_state;
     METHOD method;
 
-    char real_file[FILENAME_LEN];       // real name: doc_root+url
+    char real_file[FILENAME_LEN];       // real name: doc_root+url, or the dir of the route+the rest
     char* url;
+    route_trie::match route;            // of url, set with the target of the request
     char* version;
-    char* host;
-    int content_length;                 // length of the HTTP request
+    // the body of the request, which follows the head at check_idx
+    size_t content_length;              // of a Content-Length body
+    bool body_chunked;                  // Transfer-Encoding: chunked instead
+    size_t body_remain;                 // of a Content-Length body
+    size_t body_received;               // decoded so far, within config.max_body_size
+    chunked_decoder chunked;
+    std::unique_ptr<body_sink> sink;    // of an upload, else the body is dropped
+    int body_pipe[2];                   // splice() from the socket to the file of sink
+    bool body_splice;                   // the rest of the body is left in the socket for splice()
     bool linger = true;                 // whether to stay connected
 
+    // the file of the request being answered, moved to its reply by queue_reply()
+    std::shared_ptr<cached_file> file;  // set if the file comes from file_cache
+    // serialized response of a small file, or the body compressed for coding
+    std::shared_ptr<const std::string> response;
+    content_encoding::CODING coding;    // of the body
     char* file_address;                 // position of the file
+    int file_fd;                        // file sent by sendfile(), -1 if mapped
     struct stat file_stat;              // state of the file
 
-    struct iovec iv[2];
-    int iv_count;
-};
+    struct byte_range{
+        off_t first;
+        off_t last;                     // included
+    };
+    byte_range ranges[MAX_RANGES];      // of the file requested, none for the whole file
+    int range_count;
 
-class tw_timer{
-public:
-    void (*cb_func)(http_conn*);        // when timer expires, this function is invoked
-    http_conn* user_data;
-    tw_timer (int rot, int sl): prev(nullptr), next(nullptr)
-            ,rotation(rot), slot(sl) {}
-    tw_timer* prev;
-    tw_timer* next;
-    int rotation;                    // nums of the round
-    int slot;                        // index of slot
-};
+    // a response of the batch, or a part of one, and what has to stay alive until it is sent
+    struct reply{
+        size_t head_begin;              // its part of write_buf
+        size_t head_end;
+        const char* body;               // nullptr if in write_buf or sent by sendfile()
+        size_t body_len;
+        std::shared_ptr<cached_file> file;
+        std::shared_ptr<const std::string> whole;
+        char* mapped;                   // mapped by this reply, nullptr if none
+        size_t mapped_len;
+        int fd;                         // opened by this reply, -1 if none
+    };
+    reply replies[MAX_PIPELINE + MAX_RANGES];      // the last response may have MAX_RANGES+1 parts
+    int reply_count;
+    bool batch_full;                    // parsing stopped before the end of read_buf
 
-class time_wheel{
-public:
-    time_wheel (): curslot(0) {
-        for(auto& slot : slots)
-            slot = nullptr;
-    }
-    ~time_wheel() {
-        for(auto & slot : slots){
-            tw_timer* tmp = slot;
-            while(tmp){
-                tmp = tmp->next;
-                delete slot;
-                slot = tmp;
-            }
-        }
-    }
-
-    tw_timer* add_timer(int timeout) {
-        if (timeout<=0)
-            return new tw_timer(0, 0);
-        int tick;
-        if (timeout < TI)
-            tick = 1;
-        else
-            tick = timeout / TI;
-        int whichrot = tick / Numslot;
-        int whichslot = (curslot + tick % Numslot) % Numslot;
-        auto* tmp = new tw_timer(whichrot, whichslot);
-        if (!slots[whichslot]) {
-            // this node is the head of the list
-            printf("Add timer rotation is %d, "
-                   "slot is %d, curslot is %d, \n", whichrot, whichslot, curslot);
-            slots[whichslot] = tmp;
-        } else {
-            tmp->next = slots[whichslot];
-            slots[whichslot] = slots[whichslot]->prev = tmp;
-        }
-        return tmp;
-    }
-    void del_timer (tw_timer* timer) {
-        if (!timer)
-            return;
-        // if this is the head of the list
-        int slot = timer->slot;
-        if (timer == slots[slot]) {
-            slots[slot] = timer->next;
-            if (slots[slot])
-                slots[slot]->prev = nullptr;
-            delete timer;
-        } else {
-            //this is not the head, so it has the prev node
-            timer->prev->next = timer->next;
-            if (timer->next)
-                timer->next->prev = timer->prev;
-            delete timer;
-        }
-    }
-    void tick() {
-        // delete timers on curslot
-        tw_timer* tmp = slots[curslot];
-        std::cout << "Current slot is " << curslot << std::endl;
-        while (tmp) {
-            if (tmp->rotation) {
-                tmp->rotation--;
-                tmp = tmp->next;
-            } else {
-                tmp->cb_func(tmp->user_data);
-                if (tmp == slots[curslot]) {
-                    slots[curslot] = tmp->next;
-                    if (slots[curslot])
-                        slots[curslot]->prev = nullptr;
-                    delete tmp;
-                    tmp = slots[curslot];
-                } else {
-                    tmp->prev->next = tmp->next;
-                    if (tmp->next)
-                        tmp->next->prev = tmp->prev;
-                    tw_timer* tmp2 = tmp->next;
-                    delete tmp;
-                    tmp = tmp2;
-                }
-            }
-        }
-        curslot = (++curslot) % Numslot;
-    }
-private:
-    static const int Numslot = 60;
-    static const int TI = 1;                            // period betweei slots
-    int curslot;
-    tw_timer* slots[Numslot];
+    struct iovec iv[2 * (MAX_PIPELINE + MAX_RANGES)];
+    int iv_count;
+    int iv_start;                       // first entry not completely sent
+    long bytes_to_send;                 // what is left of iv and the file
+    int send_fd;                        // body of the last reply for sendfile(), -1 if none
+    off_t file_offset;                  // next byte of send_fd to send
+    size_t file_remain;
+    // body of the last reply, sent chunk by chunk after the batch, nullptr if none
+    std::unique_ptr<body_stream> stream;
+    buffer chunk_buf;                   // the chunk being sent, with its size and CRLF
+    bool stream_ended;                  // the last chunk is in iv
+    bool stream_polled;                 // the wait_fd() of stream is in epollfd
+    // the coroutine answering the last request of the batch, started once the batch is out
+    std::unique_ptr<request> req;       // which handler refers to
+    task<::response> handler;
 };
 
 #endif //WEBSERVER_HTTP_CONN_H
@@ -0,0 +1,43 @@
+//
+// Created by tyz on 23-5-27.
+//
+
+#ifndef WEBSERVER_HTTP_DATE_H
+#define WEBSERVER_HTTP_DATE_H
+// C system headers
+#include <ctime>
+// C++ system headers
+#include <atomic>
+#include <cstddef>
+#include <string_view>
+
+/**
+ * @brief the Date header line of the current second, formatted once
+ *
+ * The loops call refresh() after every wait, it formats the line only when
+ * the second has changed and publishes it with a release store of its slot.
+ * The heads are written by any thread, which copy the published slot. A
+ * slot is written again SLOTS seconds after it was published, long after a
+ * copy of LEN bytes which started before has ended.
+ */
+class http_date{
+public:
+    static const size_t LEN = 37;       // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    static const size_t DATE_LEN = 29;  // "Sun, 06 Nov 1994 08:49:37 GMT"
+
+    static void refresh();
+    static void copy(char* out);        // LEN bytes
+
+    // IMF-fixdate of t, DATE_LEN bytes at out
+    static void format(char* out, time_t t);
+    // any of the three formats of RFC 7231 7.1.1.1, false if text is none
+    static bool parse(std::string_view text, time_t& t);
+
+private:
+    static const int SLOTS = 4;
+    static char lines[SLOTS][LEN];
+    static std::atomic<int> published;
+    static std::atomic<time_t> second;  // of the published line
+};
+
+#endif //WEBSERVER_HTTP_DATE_H
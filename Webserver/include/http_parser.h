@@ -0,0 +1,88 @@
+//
+// Created by tyz on 23-5-26.
+//
+
+#ifndef WEBSERVER_HTTP_PARSER_H
+#define WEBSERVER_HTTP_PARSER_H
+// C++ system headers
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// bytes of a request, counted from its first byte: the buffer may move
+struct http_slice{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct http_header{
+    http_slice name;
+    http_slice value;                   // without the spaces around it
+};
+
+/**
+ * @brief parser of a request head, from the request line to the blank line
+ *
+ * The delimiters ('\r', '\n', ':') are searched 16 bytes at a time with
+ * SSE4.2 or 32 with AVX2, whichever the cpu has (CPUID, once), and every
+ * byte of the head is looked at once. parse() may be called again as more
+ * bytes arrive, it resumes where the last call stopped. Nothing is
+ * written: the result is a table of slices of the request.
+ *
+ * The names the server knows are recognized as their line is parsed, with a
+ * perfect hash of the length and the first and last letters, and known[]
+ * gives their header in O(1). The others are only in the table.
+ */
+class http_parser{
+public:
+    static const int MAX_HEADERS = 64;
+    enum RESULT{PARSE_OK=0, PARSE_INCOMPLETE, PARSE_BAD};
+    enum ISA{ISA_SCALAR=0, ISA_SSE42, ISA_AVX2};
+    enum HEADER{HEADER_ACCEPT=0, HEADER_ACCEPT_CHARSET, HEADER_ACCEPT_ENCODING,
+            HEADER_ACCEPT_LANGUAGE, HEADER_AUTHORIZATION, HEADER_CACHE_CONTROL,
+            HEADER_CONNECTION, HEADER_CONTENT_ENCODING, HEADER_CONTENT_LENGTH,
+            HEADER_CONTENT_TYPE, HEADER_COOKIE, HEADER_DATE, HEADER_EXPECT,
+            HEADER_HOST, HEADER_IF_MATCH, HEADER_IF_MODIFIED_SINCE,
+            HEADER_IF_NONE_MATCH, HEADER_IF_RANGE, HEADER_IF_UNMODIFIED_SINCE,
+            HEADER_KEEP_ALIVE, HEADER_ORIGIN, HEADER_PRAGMA, HEADER_RANGE,
+            HEADER_REFERER, HEADER_TRANSFER_ENCODING, HEADER_UPGRADE,
+            HEADER_USER_AGENT,
+            HEADER_COUNT, HEADER_OTHER = HEADER_COUNT};
+
+    static ISA isa();                   // kernels in use
+    static const char* isa_name(ISA isa);
+    static bool use(ISA isa);           // before any thread parses, false if the cpu lacks it
+    // the HEADER of a name in any case, HEADER_OTHER if it isn't known
+    static HEADER lookup(const char* name, size_t len);
+    static const char* header_name(HEADER h);
+    static std::string_view view(const char* base, http_slice s) {
+        return std::string_view(base + s.offset, s.length);
+    }
+
+    http_parser() { reset(); }
+    void reset();
+    // the first header of a name, nullptr if absent
+    const http_header* header(HEADER h) const { return known[h] ? &headers[known[h] - 1] : nullptr; }
+    // the same by name in any case, base: first byte of the request parsed
+    const http_header* header(const char* base, std::string_view name) const;
+    // base: first byte of the request, len: bytes received from there
+    RESULT parse(const char* base, size_t len);
+
+    // valid after PARSE_OK
+    http_slice method;
+    http_slice url;
+    http_slice version;
+    http_header headers[MAX_HEADERS];
+    int header_count;
+    uint8_t known[HEADER_COUNT];        // 1 + index in headers of the first of a name, 0 if absent
+    size_t length;                      // complete lines so far, the head after PARSE_OK
+
+private:
+    bool request_line(const char* base, const char* line, const char* eol);
+
+    size_t scan;                        // nothing to find before it in the current line
+    size_t colon;                       // of the current header line, 0 if not met yet
+    bool in_headers;
+};
+
+#endif //WEBSERVER_HTTP_PARSER_H
@@ -0,0 +1,94 @@
+//
+// Created by tyz on 23-5-24.
+//
+
+#ifndef WEBSERVER_MPMC_QUEUE_H
+#define WEBSERVER_MPMC_QUEUE_H
+// C++ system headers
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/**
+ * @brief bounded lock-free multi-producer multi-consumer ring (D. Vyukov)
+ *
+ * Every cell carries a sequence number telling whether it is free for the
+ * producer of this lap or full for the consumer of this lap, so producers
+ * and consumers only contend on their own position with one CAS each and
+ * nothing is allocated after construction.
+ */
+template<typename T>
+class mpmc_queue{
+public:
+    explicit mpmc_queue(size_t min_capacity) {
+        size_t capacity = 2;
+        while (capacity < min_capacity)
+            capacity <<= 1;
+        mask = capacity - 1;
+        cells.reset(new cell[capacity]);
+        for (size_t i = 0; i < capacity; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+    mpmc_queue(const mpmc_queue&) = delete;
+    mpmc_queue& operator=(const mpmc_queue&) = delete;
+
+    // false if the ring is full
+    bool push(const T& data) {
+        cell* c;
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            c = &cells[pos & mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        c->data = data;
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // false if the ring is empty
+    bool pop(T& data) {
+        cell* c;
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            c = &cells[pos & mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        data = c->data;
+        c->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct cell{
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<cell[]> cells;
+    size_t mask;
+    // on their own cache lines, producers and consumers don't share them
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+};
+
+#endif //WEBSERVER_MPMC_QUEUE_H
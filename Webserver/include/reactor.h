@@ -0,0 +1,87 @@
+//
+// Created by tyz on 23-5-20.
+//
+
+#ifndef WEBSERVER_REACTOR_H
+#define WEBSERVER_REACTOR_H
+// C system headers
+#include <netinet/in.h>
+#include <sys/epoll.h>
+// C++ system headers
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+// .h files in this project
+#include "conn_table.h"
+#include "event_loop.h"
+#include "http_conn.h"
+#include "threadpool.h"
+
+const int MAX_EVENT_NUMBER = 10000;
+const int TIMESLOT = 1;
+const int HEADER_TIMEOUT = 8 * 1000;                        // ms from accept to the first request
+const int KEEPALIVE_TIMEOUT = 30 * 1000;                    // ms from the last read
+
+/**
+ * @brief One event loop: an epollfd, a time_wheel and the connections it owns.
+ *
+ * In the default mode main() drives a single reactor on its own thread.
+ * With sub-reactors every reactor runs loop() on a dedicated thread and the
+ * acceptor hands new fds over through dispatch(), or, with SO_REUSEPORT,
+ * accepts on a listening socket of its own.
+ */
+class reactor: public event_loop{
+public:
+    explicit reactor(threadpool<http_conn>* pool);
+    ~reactor() override;
+    reactor(const reactor&) = delete;
+    reactor& operator=(const reactor&) = delete;
+
+    void start(int cpu = -1);                               // run loop() on a new thread
+    void listen_on(int fd);                                 // accept on a SO_REUSEPORT socket
+    void stop();
+    void dispatch(int connfd, const sockaddr_in& addr);     // called by the acceptor
+    void add_conn(int connfd, const sockaddr_in& addr);     // called by the owning thread
+    void handle_event(const epoll_event& event);
+    void tick();
+    void arm_timer();                                       // program the timerfd for the next timer
+    void handle_timer();                                    // the timerfd expired
+    void close_conn(http_conn* conn);                       // cancel its timer and close it
+    void conn_closed() override { conn_count.fetch_sub(1, std::memory_order_relaxed); }
+    void wake(http_conn* conn) override { resume_write(conn); }
+    bool watch(http_conn* conn, int fd, uint32_t events) override;
+    bool sleep(http_conn* conn, int ms) override;
+    bool read_file(http_conn* conn) override;
+    void forget(http_conn* conn) override;
+
+    int get_epollfd() const override { return epollfd; }
+    int get_listenfd() const { return listenfd; }
+    int get_timerfd() const { return timerfd; }
+    int load() const { return conn_count.load(std::memory_order_relaxed); }
+
+private:
+    void loop();
+    void drain_pending();
+    void accept_conns();
+    void submit(http_conn* conn);                           // process() it on the threadpool
+    void resume_write(http_conn* conn);                     // the socket, its body_stream or its handler is ready
+
+    int epollfd;
+    int wakeupfd;                                           // eventfd, wakes loop() up
+    int listenfd;                                           // -1 unless listen_on() is used
+    int timerfd;                                            // -1 unless config.timer is TIMER_FD
+    uint64_t timer_deadline;                                // programmed in timerfd, 0 if disarmed
+    int cpu;                                                // set by start(), -1 if not pinned
+    conn_table* conns;
+    threadpool<http_conn>* pool;
+    time_wheel timer_wheel;
+    std::mutex pending_locker;
+    std::vector<std::pair<int, sockaddr_in>> pending;       // fds handed over by the acceptor
+    std::atomic<int> conn_count;
+    std::atomic<bool> stopped;
+    std::thread thread;
+};
+
+#endif //WEBSERVER_REACTOR_H
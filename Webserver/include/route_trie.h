@@ -0,0 +1,333 @@
+//
+// Created by tyz on 23-6-1.
+//
+
+#ifndef WEBSERVER_ROUTE_TRIE_H
+#define WEBSERVER_ROUTE_TRIE_H
+// C++ system headers
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+// .h files in this project
+#include "http_parser.h"
+
+/**
+ * @brief radix trie of url patterns, giving the route of a path in one walk
+ * along it
+ *
+ * A pattern is made of bytes matched as they are, of ":name" segments
+ * matching one non-empty segment of the path, whose slice is captured, and
+ * may end with '*', matching whatever follows (a prefix). ':' starts a
+ * parameter right after a '/' only.
+ *
+ * Patterns are added to a tree, compile() lays it out in one array in
+ * breadth first order, the static children of a node next to each other
+ * and sorted by their first byte. find() walks the array from the root:
+ * static edges first, then the parameter; it only goes back to the
+ * parameter of a node whose static edge leads nowhere. The deepest prefix
+ * passed is the answer when no pattern matches the whole path.
+ *
+ * Everything is constexpr: static_router compiles a table of patterns known
+ * at build time into arrays, the same find() walks them.
+ */
+class route_trie{
+public:
+    static const int MAX_PARAMS = 8;    // captured by a match, the others fail it
+    struct node{
+        uint32_t label;                 // of the edge leading here, in the labels
+        uint32_t label_len;
+        uint32_t first_child;           // static children, child_count of them
+        uint32_t child_count;
+        int32_t param;                  // child matching a parameter, -1 if none
+        int32_t exact;                  // route of a pattern ending here, -1 if none
+        int32_t prefix;                 // route of a pattern ending here with '*', -1 if none
+        char first;                     // first byte of the label
+    };
+    struct match{
+        int route;
+        uint32_t rest;                  // bytes of the path matched, the rest is in the '*'
+        int param_count;
+        http_slice params[MAX_PARAMS];  // of the path, in the order of the pattern
+    };
+
+    /**
+     * @brief add pattern, answered by route
+     * @return false if it is malformed, or already added
+     */
+    constexpr bool add(std::string_view pattern, int route) {
+        if (tree.empty())
+            tree.emplace_back();
+        int n = 0;
+        size_t i = 0;
+        while (i < pattern.size()) {
+            if (pattern[i] == '*') {
+                if (i + 1 != pattern.size() || tree[n].prefix != -1)
+                    return false;
+                tree[n].prefix = route;
+                return true;
+            }
+            if (is_param(pattern, i)) {
+                size_t end = segment_end(pattern, i);
+                if (end == i + 1)
+                    return false;                       // no name
+                if (tree[n].param == -1) {
+                    int id = static_cast<int>(tree.size());
+                    tree.emplace_back();
+                    tree[n].param = id;
+                }
+                n = tree[n].param;
+                i = end;
+                continue;
+            }
+            size_t end = i + 1;
+            while (end < pattern.size() && pattern[end] != '*' && !is_param(pattern, end))
+                ++end;
+            std::string_view run = pattern.substr(i, end - i);
+            int child = -1;
+            for (int c : tree[n].children) {
+                if (tree[c].label[0] == run[0])
+                    child = c;
+            }
+            if (child == -1) {
+                int id = static_cast<int>(tree.size());
+                tree.emplace_back();
+                tree[id].label = std::string(run);
+                tree[n].children.push_back(id);
+                n = id;
+                i = end;
+                continue;
+            }
+            size_t k = 0;
+            size_t label_len = tree[child].label.size();
+            while (k < label_len && k < run.size() && tree[child].label[k] == run[k])
+                ++k;
+            if (k < label_len) {
+                // split the edge where the pattern leaves it
+                int mid = static_cast<int>(tree.size());
+                tree.emplace_back();
+                tree[mid].label = tree[child].label.substr(0, k);
+                tree[child].label.erase(0, k);
+                tree[mid].children.push_back(child);
+                std::replace(tree[n].children.begin(), tree[n].children.end(), child, mid);
+                child = mid;
+            }
+            n = child;
+            i += k;
+        }
+        if (tree[n].exact != -1)
+            return false;
+        tree[n].exact = route;
+        return true;
+    }
+
+    // room for patterns of bytes in all, there is a node for a byte at most
+    constexpr void reserve(size_t bytes) { tree.reserve(bytes + 1); }
+
+    /**
+     * @brief lay the tree out in nodes and labels, for find()
+     */
+    constexpr void compile() {
+        nodes.clear();
+        labels.clear();
+        if (tree.empty())
+            tree.emplace_back();
+        std::vector<int> order{0};          // the tree nodes, in the order of nodes
+        for (size_t k = 0; k < order.size(); ++k) {
+            tree_node& t = tree[order[k]];
+            std::sort(t.children.begin(), t.children.end(), [this](int a, int b) {
+                return static_cast<unsigned char>(tree[a].label[0]) < static_cast<unsigned char>(tree[b].label[0]);
+            });
+            node n{};
+            n.label = static_cast<uint32_t>(labels.size());
+            n.label_len = static_cast<uint32_t>(t.label.size());
+            n.first = t.label.empty() ? '\0' : t.label[0];
+            labels += t.label;
+            n.first_child = static_cast<uint32_t>(order.size());
+            n.child_count = static_cast<uint32_t>(t.children.size());
+            for (int c : t.children)
+                order.push_back(c);
+            n.param = -1;
+            if (t.param != -1) {
+                n.param = static_cast<int32_t>(order.size());
+                order.push_back(t.param);
+            }
+            n.exact = t.exact;
+            n.prefix = t.prefix;
+            nodes.push_back(n);
+        }
+    }
+
+    constexpr bool find(std::string_view path, match& m) const {
+        return find(nodes.data(), labels.data(), path, m);
+    }
+
+    /**
+     * @brief the route of path in a compiled trie
+     * @return false if no pattern matches it
+     */
+    static constexpr bool find(const node* nodes, const char* labels, std::string_view path, match& m) {
+        struct state{
+            uint32_t node;
+            uint32_t pos;
+            int param_count;
+        };
+        state alternatives[MAX_PARAMS];     // parameters skipped for a static edge
+        int alternative_count = 0;
+        match longest{};                    // through the deepest prefix
+        longest.route = -1;
+        m.param_count = 0;
+        uint32_t n = 0;
+        uint32_t i = 0;
+        const uint32_t size = static_cast<uint32_t>(path.size());
+        bool resumed = false;
+        while (true) {
+            const node& t = nodes[n];
+            if (!resumed) {
+                // deeper only: at a tie, the static edges were walked first
+                if (t.prefix != -1 && (longest.route == -1 || i > longest.rest)) {
+                    longest = m;
+                    longest.route = t.prefix;
+                    longest.rest = i;
+                }
+                if (i == size && t.exact != -1) {
+                    m.route = t.exact;
+                    m.rest = i;
+                    return true;
+                }
+                uint32_t next = i < size ? child(nodes, t, path[i]) : 0;
+                if (next != 0 && nodes[next].label_len <= size - i &&
+                    path.substr(i, nodes[next].label_len) ==
+                    std::string_view(labels + nodes[next].label, nodes[next].label_len)) {
+                    if (t.param != -1 && alternative_count < MAX_PARAMS)
+                        alternatives[alternative_count++] = {n, i, m.param_count};
+                    n = next;
+                    i += nodes[next].label_len;
+                    continue;
+                }
+            }
+            resumed = false;
+            if (t.param != -1 && i < size && path[i] != '/' && m.param_count < MAX_PARAMS) {
+                uint32_t end = i + 1;
+                while (end < size && path[end] != '/')
+                    ++end;
+                m.params[m.param_count++] = {i, end - i};
+                n = static_cast<uint32_t>(t.param);
+                i = end;
+                continue;
+            }
+            if (alternative_count == 0)
+                break;
+            const state& back = alternatives[--alternative_count];
+            n = back.node;
+            i = back.pos;
+            m.param_count = back.param_count;
+            resumed = true;
+        }
+        if (longest.route == -1)
+            return false;
+        m = longest;
+        return true;
+    }
+
+    std::vector<node> nodes;            // compiled, the root first
+    std::string labels;
+
+private:
+    struct tree_node{
+        std::string label;
+        std::vector<int> children;
+        int param = -1;
+        int exact = -1;
+        int prefix = -1;
+    };
+
+    static constexpr bool is_param(std::string_view pattern, size_t i) {
+        return pattern[i] == ':' && i > 0 && pattern[i - 1] == '/';
+    }
+    static constexpr size_t segment_end(std::string_view s, size_t i) {
+        while (i < s.size() && s[i] != '/')
+            ++i;
+        return i;
+    }
+    // the static child of t whose label starts with c, 0 if none: the root is no child
+    static constexpr uint32_t child(const node* nodes, const node& t, char c) {
+        uint32_t lo = t.first_child;
+        uint32_t hi = t.first_child + t.child_count;
+        auto key = static_cast<unsigned char>(c);
+        while (hi - lo > 4) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (static_cast<unsigned char>(nodes[mid].first) < key)
+                lo = mid + 1;
+            else
+                hi = mid + 1;                           // mid may be it
+        }
+        for (; lo < hi; ++lo) {
+            if (nodes[lo].first == c)
+                return lo;
+        }
+        return 0;
+    }
+
+    std::vector<tree_node> tree;        // as added, the root first
+};
+
+/**
+ * @brief a route_trie of patterns known at build time, compiled by the
+ * compiler into arrays
+ *
+ * Patterns is a constexpr array of string_view, a route is its index in it.
+ * A malformed or repeated pattern fails the build.
+ * The compiler takes seconds for a thousand patterns.
+ */
+template<const auto& Patterns>
+class static_router{
+public:
+    static constexpr size_t size() { return std::size(Patterns); }
+    static constexpr bool find(std::string_view path, route_trie::match& m) {
+        return route_trie::find(table.nodes.data(), table.labels.data(), path, m);
+    }
+    // the index of the pattern matching path, -1 if none
+    static constexpr int find(std::string_view path) {
+        route_trie::match m{};
+        return find(path, m) ? m.route : -1;
+    }
+
+private:
+    static constexpr route_trie build() {
+        route_trie trie;
+        size_t bytes = 0;
+        for (std::string_view pattern : Patterns)
+            bytes += pattern.size();
+        trie.reserve(bytes);                // moving the nodes is what costs at compile time
+        int route = 0;
+        for (std::string_view pattern : Patterns) {
+            if (!trie.add(pattern, route++))
+                throw "malformed or repeated route pattern";
+        }
+        trie.compile();
+        return trie;
+    }
+    // the sizes of the arrays, then the arrays: what is allocated at compile time stays there
+    static constexpr std::array<size_t, 2> sizes = [] {
+        route_trie trie = build();
+        return std::array<size_t, 2>{trie.nodes.size(), trie.labels.size()};
+    }();
+    struct arrays{
+        std::array<route_trie::node, sizes[0]> nodes;
+        std::array<char, sizes[1] + 1> labels;
+    };
+    static constexpr arrays table = [] {
+        route_trie trie = build();
+        arrays a{};
+        std::copy(trie.nodes.begin(), trie.nodes.end(), a.nodes.begin());
+        std::copy(trie.labels.begin(), trie.labels.end(), a.labels.begin());
+        return a;
+    }();
+};
+
+#endif //WEBSERVER_ROUTE_TRIE_H
@@ -0,0 +1,49 @@
+//
+// Created by tyz on 23-6-1.
+//
+
+#ifndef WEBSERVER_ROUTER_H
+#define WEBSERVER_ROUTER_H
+// C++ system headers
+#include <string>
+#include <string_view>
+#include <vector>
+// .h files in this project
+#include "route_trie.h"
+
+/**
+ * @brief the routes of the server: url patterns of route_trie, and the
+ * target answering each method there
+ *
+ * Targets are numbers given by the owner of the router. Routes are added
+ * before the loops start, every add() compiles the trie again; find() only
+ * reads it and may be called by any thread.
+ */
+class router{
+public:
+    static const int MAX_METHODS = 16;
+
+    // target answers method (< MAX_METHODS) on pattern, false if pattern is
+    // malformed, conflicts with another or has a target for method already
+    bool add(std::string_view pattern, int method, int target);
+    // the target of method on path, -1 if none: m.route is -1 too if no
+    // pattern matches path, else methods() of it tells what is allowed
+    int find(int method, std::string_view path, route_trie::match& m) const;
+    unsigned methods(int route) const { return routes[route].methods; }     // bit per method with a target
+    // the value of the parameter name in path, data() is nullptr if the route has none
+    std::string_view param(const route_trie::match& m, std::string_view path, std::string_view name) const;
+    size_t size() const { return routes.size(); }
+
+private:
+    struct route{
+        std::string pattern;
+        std::vector<std::string> params;    // names, in the order of the pattern
+        int targets[MAX_METHODS];
+        unsigned methods;
+    };
+
+    route_trie trie;
+    std::vector<route> routes;          // by the route numbers in trie
+};
+
+#endif //WEBSERVER_ROUTER_H
@@ -0,0 +1,125 @@
+//
+// Created by tyz on 23-5-31.
+//
+
+#ifndef WEBSERVER_TASK_H
+#define WEBSERVER_TASK_H
+// C++ system headers
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+/**
+ * @brief a coroutine giving a T, started when it is awaited
+ *
+ * co_await of a task runs it until its end, then resumes the awaiting
+ * coroutine in its place (symmetric transfer, the stack doesn't grow with
+ * the depth of the calls). An exception leaving the coroutine is thrown
+ * again by the co_await. The task which is awaited by nobody, a handler,
+ * is driven by http_conn through handle() and done().
+ */
+template<typename T>
+class task;
+
+namespace task_detail {
+    // back to whoever awaited the task, or to resume() of the top level
+    struct final_awaiter{
+        bool await_ready() noexcept { return false; }
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> done) noexcept {
+            std::coroutine_handle<> next = done.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    // the promise of task<T> but for how the value is returned
+    class promise_base{
+    public:
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { error = std::current_exception(); }
+
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+    };
+
+    template<typename T>
+    class promise: public promise_base{
+    public:
+        task<T> get_return_object();
+        template<typename U>
+        void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+        T result() {
+            if (error)
+                std::rethrow_exception(error);
+            return std::move(*value);
+        }
+
+        std::optional<T> value;
+    };
+
+    template<>
+    class promise<void>: public promise_base{
+    public:
+        task<void> get_return_object();
+        void return_void() {}
+        void result() {
+            if (error)
+                std::rethrow_exception(error);
+        }
+    };
+}
+
+template<typename T>
+class task{
+public:
+    typedef task_detail::promise<T> promise_type;
+
+    task() = default;
+    explicit task(std::coroutine_handle<promise_type> h): h(h) {}
+    task(task&& other) noexcept: h(std::exchange(other.h, nullptr)) {}
+    task& operator=(task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            h = std::exchange(other.h, nullptr);
+        }
+        return *this;
+    }
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task() { reset(); }
+
+    // the frame goes, and the frames of the tasks it awaits with it
+    void reset() {
+        if (h)
+            std::exchange(h, nullptr).destroy();
+    }
+    explicit operator bool() const { return static_cast<bool>(h); }
+    std::coroutine_handle<> handle() const { return h; }
+    bool done() const { return h.done(); }
+    T result() { return h.promise().result(); }             // once done()
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        h.promise().continuation = caller;
+        return h;
+    }
+    T await_resume() { return h.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> h;
+};
+
+namespace task_detail {
+    template<typename T>
+    task<T> promise<T>::get_return_object() {
+        return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+    }
+    inline task<void> promise<void>::get_return_object() {
+        return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+    }
+}
+
+#endif //WEBSERVER_TASK_H
@@ -5,52 +5,116 @@
 #ifndef WEBSERVER_THREADPOOL_H
 #define WEBSERVER_THREADPOOL_H
 
+// C system headers
+#include <pthread.h>
 // C++ system headers
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
 #include <cstdio>
 #include <exception>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
+// .h files in this project
+#include "config.h"
+#include "eventcount.h"
+#include "mpmc_queue.h"
+#include "ws_deque.h"
 
+/**
+ * @brief workers running T::process()
+ *
+ * config.queue picks the queue:
+ * - QUEUE_STEALING (default): every worker has an inbox filled by append()
+ *   and a Chase-Lev deque it moves batches of the inbox to. A worker with
+ *   nothing to do steals from the deques and inboxes of the others, then
+ *   parks on the eventcount.
+ * - QUEUE_LOCKFREE: one bounded lock-free ring shared by all workers.
+ * - QUEUE_MUTEX: the std::list under a mutex and a condition variable.
+ */
 template<typename T>
 class threadpool {
 public:
     static threadpool* Getinstance (int para_max_request=10000) {
-        std::once_flag init_flag;
+        static std::once_flag init_flag;
         std::call_once(init_flag, [&] {
             uniqueinstance = new threadpool(para_max_request);
         });
         return uniqueinstance;
     }
     ~threadpool();
-    bool append(T* request);
+    // hint: the cpu of the calling reactor, whose worker is preferred, -1 for the least loaded
+    bool append(T* request, int hint = -1);
+    // worker i runs on cpus[i % size] with QUEUE_STEALING, and takes the requests of a reactor there
+    void pin(const std::vector<int>& cpus);
 
 private:
+    static const int STEAL_BATCH = 32;                 // moved from the inbox to the deque at once
+    static const int DEQUE_CAPACITY = 32;
+    // find_work() moves a batch to an empty deque: it has to fit
+    static_assert(DEQUE_CAPACITY >= STEAL_BATCH, "a batch of the inbox must fit in the deque");
+    struct alignas(64) worker{
+        explicit worker(int capacity): inbox(capacity), deque(DEQUE_CAPACITY) {}
+        mpmc_queue<T*> inbox;
+        ws_deque<T*> deque;
+        std::atomic<int> queued{0};                    // requests in inbox and deque
+    };
+
     explicit threadpool(int);
     static threadpool* uniqueinstance;
-    void run();
+    void run(int self);
+    T* take(int self);                                 // blocks, nullptr once stopped
+    bool find_work(int self, T*& request);
+    int pick_worker(int hint);
 private:
     unsigned int thread_num;                           // number of threads in the pool
     int max_request;                                   // max of requests
-    std::vector<std::thread> threads;                  // array of threads
+    std::vector<pthread_t> threads;                    // detached, for pin()
+    QUEUE_MODE mode;
+    // QUEUE_STEALING
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<int> cpu_workers;                      // by cpu, the worker pinned there, -1 if none
+    // QUEUE_LOCKFREE
+    mpmc_queue<T*> ring;
+    eventcount parked;                                 // idle workers sleep here, with QUEUE_STEALING too
+    // QUEUE_MUTEX
     std::list<T*> workqueue;
     std::mutex queuelocker;
     std::condition_variable queuestat;
-    bool stop;
+    std::atomic<bool> stop;
 };
 template<typename T>
 threadpool<T>* threadpool<T>::uniqueinstance = nullptr;
 
 template<typename T>
-bool threadpool<T>::append(T* request) {
+bool threadpool<T>::append(T* request, int hint) {
+    if (mode == QUEUE_STEALING) {
+        int n = static_cast<int>(workers.size());
+        int first = pick_worker(hint);
+        for (int i = 0; i < n; ++i) {
+            worker& w = *workers[(first + i) % n];
+            w.queued.fetch_add(1, std::memory_order_relaxed);
+            if (w.inbox.push(request)) {
+                parked.notify_one();
+                return true;
+            }
+            w.queued.fetch_sub(1, std::memory_order_relaxed);
+        }
+        return false;
+    }
+    if (mode == QUEUE_LOCKFREE) {
+        if (!ring.push(request))
+            return false;
+        parked.notify_one();
+        return true;
+    }
     {
         std::lock_guard<std::mutex> guard1(queuelocker);
-        if (workqueue.size() > max_request) {
-            queuelocker.unlock();
+        if (workqueue.size() >= max_request)
             return false;
-        }
         workqueue.emplace_back(request);
     }
     queuestat.notify_one();
@@ -59,40 +123,162 @@ bool threadpool<T>::append(T* request) {
 
 template<typename T>
 threadpool<T>::threadpool(int n1):
-    thread_num(std::thread::hardware_concurrency()), max_request(n1), stop(false)
+    thread_num(std::max(std::thread::hardware_concurrency(), 1u)), max_request(n1),
+    mode(config.queue), ring(mode == QUEUE_LOCKFREE && n1 > 0 ? n1 : 1), stop(false)
 {
     if (n1 <= 0)
         throw std::exception();
 
+    if (mode == QUEUE_STEALING) {
+        int capacity = std::max(n1 / static_cast<int>(thread_num), 256);
+        for (unsigned int i = 0; i < thread_num; ++i)
+            workers.emplace_back(new worker(capacity));
+    }
     try {
-        for (int i = 0; i < thread_num; ++i) {
-            printf("create the %dth thread\n", i);
-            threads.emplace_back(&threadpool::run, this);
+        for (unsigned int i = 0; i < thread_num; ++i) {
+            printf("create the %uth thread\n", i);
+            std::thread t(&threadpool::run, this, i);
+            threads.push_back(t.native_handle());
+            t.detach();
         }
     } catch(...) {
         stop = true;
         throw std::runtime_error("Create thread fails !");
     }
-    for (int i = 0; i < thread_num; ++i)
-        threads[i].detach();
+}
+
+template<typename T>
+void threadpool<T>::pin(const std::vector<int>& cpus) {
+    if (mode != QUEUE_STEALING || cpus.empty())
+        return;
+    cpu_workers.assign(*std::max_element(cpus.begin(), cpus.end()) + 1, -1);
+    for (unsigned int i = 0; i < thread_num; ++i) {
+        // worker i shares the cpu of reactor i, which hands it its requests
+        int cpu = cpus[i % cpus.size()];
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        pthread_setaffinity_np(threads[i], sizeof(cpuset), &cpuset);
+        if (cpu_workers[cpu] == -1)
+            cpu_workers[cpu] = static_cast<int>(i);
+    }
 }
 
 template<typename T>
 threadpool<T>::~threadpool() {
-   stop = true;
-   queuestat.notify_all();
+    stop = true;
+    parked.notify_all();
+    {
+        // a worker between its predicate check and its wait would miss the notify
+        std::lock_guard<std::mutex> guard1(queuelocker);
+    }
+    queuestat.notify_all();
 }
 
+/**
+ * @brief the worker for a request, round robin from there if its inbox is full
+ */
 template<typename T>
-void threadpool<T>::run() {
-    while (!stop) {
-    	std::unique_lock<std::mutex> guard1(queuelocker);
-        queuestat.wait(guard1);
-        if(workqueue.empty()){
-            continue;
+int threadpool<T>::pick_worker(int hint) {
+    int n = static_cast<int>(workers.size());
+    if (hint >= 0 && hint < static_cast<int>(cpu_workers.size()) && cpu_workers[hint] != -1)
+        return cpu_workers[hint];
+    if (hint >= 0)
+        return hint % n;
+    // the less loaded of two random workers, cheaper than scanning all of them
+    static thread_local unsigned seed = static_cast<unsigned>(
+            reinterpret_cast<uintptr_t>(&seed) >> 4) | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    int a = static_cast<int>(seed % n);
+    int b = static_cast<int>((seed >> 16) % n);
+    return workers[a]->queued.load(std::memory_order_relaxed) <=
+           workers[b]->queued.load(std::memory_order_relaxed) ? a : b;
+}
+
+/**
+ * @brief own deque, then own inbox, then the deques and inboxes of the others
+ */
+template<typename T>
+bool threadpool<T>::find_work(int self, T*& request) {
+    worker& me = *workers[self];
+    if (me.deque.take(request)) {
+        me.queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    if (me.inbox.pop(request)) {
+        me.queued.fetch_sub(1, std::memory_order_relaxed);
+        // the deque is empty, so a batch always fits (see DEQUE_CAPACITY)
+        int moved = 0;
+        T* extra;
+        while (moved < STEAL_BATCH && me.inbox.pop(extra)) {
+            me.deque.push(extra);
+            ++moved;
+        }
+        if (moved > 0)
+            parked.notify_one();                       // somebody idle may steal them
+        return true;
+    }
+    int n = static_cast<int>(workers.size());
+    for (int i = 1; i < n; ++i) {
+        worker& victim = *workers[(self + i) % n];
+        if (victim.deque.steal(request) || victim.inbox.pop(request)) {
+            victim.queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
         }
-        T* request = workqueue.front();
-        workqueue.pop_front();
+    }
+    return false;
+}
+
+template<typename T>
+T* threadpool<T>::take(int self) {
+    T* request = nullptr;
+    if (mode == QUEUE_STEALING) {
+        while (!find_work(self, request)) {
+            uint32_t key = parked.prepare_wait();
+            if (find_work(self, request)) {
+                parked.cancel_wait();
+                break;
+            }
+            if (stop) {
+                parked.cancel_wait();
+                return nullptr;
+            }
+            parked.wait(key);
+        }
+        return request;
+    }
+    if (mode == QUEUE_LOCKFREE) {
+        while (!ring.pop(request)) {
+            uint32_t key = parked.prepare_wait();
+            if (ring.pop(request)) {
+                parked.cancel_wait();
+                break;
+            }
+            if (stop) {
+                parked.cancel_wait();
+                return nullptr;
+            }
+            parked.wait(key);
+        }
+        return request;
+    }
+    // the predicate catches a notify_one() sent while no worker was waiting
+    std::unique_lock<std::mutex> guard1(queuelocker);
+    queuestat.wait(guard1, [this] { return stop || !workqueue.empty(); });
+    if (workqueue.empty())
+        return nullptr;
+    request = workqueue.front();
+    workqueue.pop_front();
+    return request;
+}
+
+template<typename T>
+void threadpool<T>::run(int self) {
+    while (!stop) {
+        // processed outside of any lock, workers don't serialize each other
+        T* request = take(self);
         if (!request) {
             continue;
         }
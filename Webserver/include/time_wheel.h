@@ -0,0 +1,205 @@
+//
+// Created by tyz on 23-5-25.
+//
+
+#ifndef WEBSERVER_TIME_WHEEL_H
+#define WEBSERVER_TIME_WHEEL_H
+// C++ system headers
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+class http_conn;
+
+/**
+ * @brief timer node embedded in the object it times, owned by one time_wheel
+ */
+class tw_timer{
+public:
+    // invoked on expiry, returns the ms after which to fire again or 0
+    int (*cb_func)(http_conn*) = nullptr;
+    http_conn* user_data = nullptr;
+
+    bool pending() const { return next != nullptr; }
+
+private:
+    friend class time_wheel;
+    tw_timer* prev = nullptr;
+    tw_timer* next = nullptr;           // nullptr when not in a wheel
+    uint64_t expire = 0;                // ms of time_wheel::clock()
+    int level = 0;
+    int slot = 0;
+};
+
+/**
+ * @brief hierarchical timing wheel with 1 ms resolution
+ *
+ * LEVELS wheels of SLOTS slots, level l holding the timers due within
+ * SLOTS^(l+1) ms. A slot of an upper level is cascaded into the lower ones
+ * when its time comes, so every timer is moved at most LEVELS-1 times.
+ * Slots are circular lists with a sentinel, which makes add, cancel and
+ * reschedule O(1) without knowing where the timer is, and a bitmap per
+ * level finds the next busy slot without scanning. Nothing is allocated:
+ * the nodes live in the timed objects. Not thread safe, every loop owns its
+ * wheel.
+ */
+class time_wheel{
+public:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const uint64_t MAX_TIMEOUT = (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;   // ~4.6 hours
+
+    static uint64_t clock() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    time_wheel(): now(clock()), count(0) {
+        for (int l = 0; l < LEVELS; ++l) {
+            occupied[l] = 0;
+            for (auto& head : slots[l])
+                head.prev = head.next = &head;
+        }
+    }
+    time_wheel(const time_wheel&) = delete;
+    time_wheel& operator=(const time_wheel&) = delete;
+
+    // (re)schedule timer to fire timeout ms from now
+    void add_timer(tw_timer* timer, uint64_t timeout) {
+        if (timer->pending())
+            unlink(timer);
+        // from the clock, now may lag behind it until the next tick()
+        timer->expire = std::max(now, clock()) + (timeout ? timeout : 1);
+        link(timer);
+    }
+    void del_timer(tw_timer* timer) {
+        if (timer && timer->pending())
+            unlink(timer);
+    }
+    // run what has expired up to the clock
+    void tick() { advance(clock()); }
+    // the clock as of the last tick(), free to read
+    uint64_t current() const { return now; }
+    // ms of clock() at which the next slot is due, 0 if the wheel is empty
+    uint64_t next_deadline() const { return count ? next_event() : 0; }
+    // ms until the next slot to process, -1 if the wheel is empty
+    int next_timeout() const {
+        if (count == 0)
+            return -1;
+        uint64_t when = next_event(), at = clock();
+        return when > at ? static_cast<int>(when - at) : 0;
+    }
+
+private:
+    void link(tw_timer* timer) {
+        if (timer->expire - now > MAX_TIMEOUT)
+            timer->expire = now + MAX_TIMEOUT;
+        uint64_t delta = timer->expire - now;
+        int l = 0;
+        while (l < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (l + 1))))
+            ++l;
+        int s = static_cast<int>((timer->expire >> (SLOT_BITS * l)) & (SLOTS - 1));
+        tw_timer& head = slots[l][s];
+        timer->level = l;
+        timer->slot = s;
+        timer->prev = head.prev;
+        timer->next = &head;
+        head.prev->next = timer;
+        head.prev = timer;
+        occupied[l] |= uint64_t(1) << s;
+        ++count;
+    }
+    void unlink(tw_timer* timer) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = timer->next = nullptr;
+        tw_timer& head = slots[timer->level][timer->slot];
+        if (head.next == &head)
+            occupied[timer->level] &= ~(uint64_t(1) << timer->slot);
+        --count;
+    }
+    /**
+     * @brief the earliest ms > now at which a busy slot has to be processed:
+     * its expiry on level 0, its cascade on the upper levels
+     */
+    uint64_t next_event() const {
+        uint64_t best = UINT64_MAX;
+        for (int l = 0; l < LEVELS; ++l) {
+            if (!occupied[l])
+                continue;
+            int shift = SLOT_BITS * l;
+            uint64_t base = now >> shift;
+            // rotate so that bit 0 is the slot after the current one
+            int from = static_cast<int>((base + 1) & (SLOTS - 1));
+            uint64_t bits = (occupied[l] >> from) | (from ? occupied[l] << (SLOTS - from) : 0);
+            uint64_t when = (base + 1 + __builtin_ctzll(bits)) << shift;
+            if (when < best)
+                best = when;
+        }
+        return best;
+    }
+    void advance(uint64_t target) {
+        while (count > 0) {
+            uint64_t t = next_event();
+            if (t > target)
+                break;
+            now = t;
+            // upper levels first, their timers may land in the slots cascaded next
+            for (int l = LEVELS - 1; l > 0; --l) {
+                if ((t & ((uint64_t(1) << (SLOT_BITS * l)) - 1)) == 0)
+                    cascade(l, static_cast<int>((t >> (SLOT_BITS * l)) & (SLOTS - 1)));
+            }
+            expire(static_cast<int>(t & (SLOTS - 1)));
+        }
+        if (target > now)
+            now = target;
+    }
+    void cascade(int l, int s) {
+        tw_timer pending;
+        take_slot(l, s, pending);
+        while (pending.next != &pending) {
+            tw_timer* timer = pending.next;
+            timer->prev->next = timer->next;
+            timer->next->prev = timer->prev;
+            --count;
+            link(timer);
+        }
+    }
+    void expire(int s) {
+        tw_timer pending;
+        take_slot(0, s, pending);
+        while (pending.next != &pending) {
+            tw_timer* timer = pending.next;
+            timer->prev->next = timer->next;
+            timer->next->prev = timer->prev;
+            timer->prev = timer->next = nullptr;
+            --count;
+            // the callback may add or delete any timer, this one included
+            int again = timer->cb_func(timer->user_data);
+            if (again > 0 && !timer->pending())
+                add_timer(timer, again);
+        }
+    }
+    // move slot (l, s) to the list of head, its timers are still counted
+    void take_slot(int l, int s, tw_timer& head) {
+        tw_timer& from = slots[l][s];
+        if (from.next == &from) {
+            head.prev = head.next = &head;
+            return;
+        }
+        head.next = from.next;
+        head.prev = from.prev;
+        head.next->prev = &head;
+        head.prev->next = &head;
+        from.prev = from.next = &from;
+        occupied[l] &= ~(uint64_t(1) << s);
+    }
+
+    uint64_t now;                       // last ms processed
+    int count;                          // timers in the wheel
+    uint64_t occupied[LEVELS];          // bit s: slot s isn't empty
+    tw_timer slots[LEVELS][SLOTS];      // sentinels
+};
+
+#endif //WEBSERVER_TIME_WHEEL_H
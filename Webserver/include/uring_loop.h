@@ -0,0 +1,129 @@
+//
+// Created by tyz on 23-5-21.
+//
+
+#ifndef WEBSERVER_URING_LOOP_H
+#define WEBSERVER_URING_LOOP_H
+// C system headers
+#include <linux/io_uring.h>
+#include <poll.h>
+// C++ system headers
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+// .h files in this project
+#include "conn_table.h"
+#include "event_loop.h"
+#include "http_conn.h"
+
+/**
+ * @brief io_uring backend: one ring per thread doing accept, recv and writev.
+ *
+ * A multishot accept and one multishot recv per connection are armed once,
+ * recv picks its buffers from a provided buffer ring. The recv of a client
+ * sending while its batch or handler is pending is cancelled once read_buf
+ * holds HIGH_WATER, and armed again as the requests are answered, and every loop
+ * iteration submits all pending SQEs and waits for completions with a single
+ * io_uring_enter. Requests are parsed and answered by http_conn::prepare()
+ * on the ring thread, so the threadpool is not involved. The waits of
+ * coroutine handlers are SQEs too: a poll, a read or a timeout.
+ */
+class uring_loop: public event_loop{
+public:
+    uring_loop();
+    ~uring_loop() override;
+    uring_loop(const uring_loop&) = delete;
+    uring_loop& operator=(const uring_loop&) = delete;
+
+    bool init(int listenfd);            // false if the kernel lacks what we need
+    void start(int cpu = -1);
+    void stop();
+    void shut(int fd);                  // close the connection once its SQEs are done
+
+    void wake(http_conn* conn) override { pump(conn->sockfd, conn); }
+    bool watch(http_conn* conn, int fd, uint32_t events) override;
+    bool sleep(http_conn* conn, int ms) override;
+    bool read_file(http_conn* conn) override;
+    void forget(http_conn* /*conn*/) override {}            // shut() cancels the SQE of the wait
+
+private:
+    enum OP{OP_ACCEPT=0, OP_RECV, OP_WRITEV, OP_TICK, OP_POLL, OP_CANCEL, OP_READ, OP_SLEEP};
+    struct conn_state{
+        bool recving;                   // the multishot recv is armed
+        bool writing;                   // a writev is in flight
+        bool waiting;                   // for the body_stream or the handler of the response
+        bool closing;
+        OP wait_op;                     // what waiting waits for
+        __kernel_timespec sleep_ts;     // of an OP_SLEEP
+        bool paused;                    // read_buf reached HIGH_WATER, the recv is cancelled
+        // received before the recv ended, kept in their buffers until read_buf has room
+        std::vector<std::pair<unsigned short, int>> parked;    // bid and length
+    };
+    static const unsigned ENTRIES = 4096;
+    static const unsigned BUF_COUNT = 4096;     // buffers of the provided buffer ring
+    static const unsigned BUF_SIZE = 4096;
+    static const int BUF_GROUP = 0;
+    static const size_t HIGH_WATER = buffer::MAX_CHUNK / 2;    // of read_buf, which stops at MAX_CHUNK
+    static const int STATE_PAGE = 1024;         // conn_state of as many fds, allocated together
+
+    bool setup_ring();
+    bool setup_buffers();
+    io_uring_sqe* get_sqe();
+    int enter(unsigned min_complete);
+    void arm_accept();
+    void arm_recv(int fd);
+    void arm_writev(int fd);
+    void arm_tick();
+    void arm_poll(int fd, int source, unsigned events = POLLIN);
+    void arm_wait(int fd, OP op);
+    conn_state& state_of(int fd);       // its page is allocated by the first use
+    void recycle_buffer(unsigned short bid);
+    void pause_recv(int fd);
+    bool unpark(int fd, http_conn* conn);
+    void on_accept(const io_uring_cqe& cqe);
+    void on_recv(int fd, const io_uring_cqe& cqe);
+    void on_writev(int fd, const io_uring_cqe& cqe);
+    void on_wait(int fd, const io_uring_cqe& cqe);
+    void respond(int fd, http_conn* conn);
+    void pump(int fd, http_conn* conn);
+    void drop(int fd);                  // shut() from the loop itself
+    void try_close(int fd);
+    void loop();
+
+    int ringfd;
+    int listenfd;
+    conn_table* conns;
+    // by fd / STATE_PAGE, as conn_table: memory follows the fds this ring has had
+    std::vector<std::unique_ptr<conn_state[]>> states;
+    time_wheel timer_wheel;
+    __kernel_timespec tick_ts;
+
+    // submission queue
+    void* sq_ptr;
+    size_t sq_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned sqe_tail;                  // local tail, published by enter()
+    unsigned sqe_submitted;
+    // completion queue
+    void* cq_ptr;
+    size_t cq_size;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    // provided buffers
+    io_uring_buf_ring* buf_ring;
+    char* bufs;
+
+    std::atomic<bool> stopped;
+    std::thread thread;
+};
+
+#endif //WEBSERVER_URING_LOOP_H
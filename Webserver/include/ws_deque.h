@@ -0,0 +1,91 @@
+//
+// Created by tyz on 23-5-24.
+//
+
+#ifndef WEBSERVER_WS_DEQUE_H
+#define WEBSERVER_WS_DEQUE_H
+// C++ system headers
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/**
+ * @brief bounded Chase-Lev work-stealing deque
+ *
+ * The owner pushes and takes at the bottom without any CAS except for the
+ * last element, thieves steal from the top with one CAS. Memory orders
+ * follow "Correct and Efficient Work-Stealing for Weak Memory Models"
+ * (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013).
+ */
+template<typename T>
+class ws_deque{
+public:
+    explicit ws_deque(int64_t min_capacity) {
+        int64_t capacity = 2;
+        while (capacity < min_capacity)
+            capacity <<= 1;
+        mask = capacity - 1;
+        cells.reset(new std::atomic<T>[capacity]);
+        top.store(0, std::memory_order_relaxed);
+        bottom.store(0, std::memory_order_relaxed);
+    }
+    ws_deque(const ws_deque&) = delete;
+    ws_deque& operator=(const ws_deque&) = delete;
+
+    // owner only, false if full
+    bool push(T data) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        if (b - t > mask)
+            return false;
+        cells[b & mask].store(data, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // owner only, false if empty
+    bool take(T& data) {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        data = cells[b & mask].load(std::memory_order_relaxed);
+        if (t == b) {
+            // the last one, race the thieves for it
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                   std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // any thread, false if empty or lost to another thief
+    bool steal(T& data) {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return false;
+        data = cells[t & mask].load(std::memory_order_relaxed);
+        return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                           std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+    }
+
+private:
+    std::unique_ptr<std::atomic<T>[]> cells;
+    int64_t mask;
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+};
+
+#endif //WEBSERVER_WS_DEQUE_H
@@ -0,0 +1,66 @@
+//
+// Created by tyz on 23-5-30.
+//
+
+// C system headers
+#include <fcntl.h>
+#include <unistd.h>
+// C++ system headers
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+// .h files in this project
+#include "body_sink.h"
+#include "config.h"
+
+spool_sink::spool_sink(handler done): done(std::move(done)), fd(-1), bytes(0) {}
+
+spool_sink::~spool_sink() {
+    if (fd != -1)
+        close(fd);
+}
+
+bool spool_sink::write(const char* data, size_t len) {
+    if (fd == -1 && buf.size() + len > config.body_memory_size && !spill())
+        return false;
+    bytes += len;
+    if (fd == -1) {
+        buf.append(data, len);
+        return true;
+    }
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief move the body to a file of config.spool_dir which has no name, it
+ * is gone with its last fd. mkstemp() and unlink() where O_TMPFILE fails.
+ */
+bool spool_sink::spill() {
+    fd = open(config.spool_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        std::string path = std::string(config.spool_dir) + "/webserver-body-XXXXXX";
+        fd = mkostemp(&path[0], O_CLOEXEC);
+        if (fd == -1)
+            return false;
+        unlink(path.c_str());
+    }
+    std::string held;
+    held.swap(buf);
+    bytes = 0;
+    return write(held.data(), held.size());
+}
+
+int spool_sink::release_file() {
+    int file = fd;
+    fd = -1;
+    return file;
+}
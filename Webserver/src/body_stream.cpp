@@ -0,0 +1,144 @@
+//
+// Created by tyz on 23-5-29.
+//
+
+// C system headers
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+// C++ system headers
+#include <cerrno>
+// .h files in this project
+#include "body_stream.h"
+
+pipe_stream::pipe_stream(int fd, std::string_view type, pid_t child)
+    : body_stream(type), fd(fd), child(child) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+pipe_stream::~pipe_stream() {
+    close(fd);
+    if (child > 0 && waitpid(child, nullptr, WNOHANG) == 0) {
+        // the client left before the end of its output
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+    }
+}
+
+/**
+ * @brief run argv with its standard output on a pipe
+ *
+ * The child gets none of the fds of the server, which has no O_CLOEXEC on
+ * its sockets, and the signal mask and dispositions a shell would give it.
+ */
+std::unique_ptr<pipe_stream> pipe_stream::spawn(const char* const argv[], std::string_view type) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return nullptr;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask, defaults;
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);                  // ignored by the server
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    pid_t pid;
+    int ret = posix_spawnp(&pid, argv[0], &actions, &attr, const_cast<char* const*>(argv), environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (ret != 0) {
+        close(fds[0]);
+        return nullptr;
+    }
+    return std::make_unique<pipe_stream>(fds[0], type, pid);
+}
+
+ssize_t pipe_stream::read(char* out, size_t len) {
+    ssize_t n;
+    do {
+        n = ::read(fd, out, len);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+file_stream::file_stream(int fd, int notifyfd, std::string_view type)
+    : body_stream(type), fd(fd), notifyfd(notifyfd), offset(0), writing(true) {}
+
+file_stream::~file_stream() {
+    close(notifyfd);
+    close(fd);
+}
+
+std::unique_ptr<file_stream> file_stream::follow(const char* path, std::string_view type) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    struct stat st{};
+    int notifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    // watched before anything is read, so that no append is missed
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || notifyfd < 0 ||
+        inotify_add_watch(notifyfd, path, IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        if (notifyfd >= 0)
+            close(notifyfd);
+        close(fd);
+        return nullptr;
+    }
+    return std::unique_ptr<file_stream>(new file_stream(fd, notifyfd, type));
+}
+
+/**
+ * @brief what is in the file past offset; at its end, EAGAIN until inotify
+ * reports a change, 0 once the writer is gone and everything has been read
+ */
+ssize_t file_stream::read(char* out, size_t len) {
+    while (true) {
+        ssize_t n = pread(fd, out, len, offset);
+        if (n != 0) {
+            if (n > 0)
+                offset += n;
+            return n;
+        }
+        if (!writing)
+            return 0;
+        // nothing new: read again only if something happened since the last look
+        bool changed = drain_events();
+        if (!changed) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+}
+
+/**
+ * @return whether there were events, writing is cleared by those which end the body
+ */
+bool file_stream::drain_events() {
+    alignas(inotify_event) char buf[4096];
+    bool any = false;
+    ssize_t n;
+    while ((n = ::read(notifyfd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n;) {
+            auto event = reinterpret_cast<const inotify_event*>(p);
+            if (event->mask & (IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                writing = false;
+            // unlink only changes the link count while the file is open here
+            struct stat st{};
+            if ((event->mask & IN_ATTRIB) && fstat(fd, &st) == 0 && st.st_nlink == 0)
+                writing = false;
+            any = true;
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+    return any;
+}
@@ -0,0 +1,89 @@
+//
+// Created by tyz on 23-5-23.
+//
+
+// C++ system headers
+#include <cstring>
+#include <new>
+#include <vector>
+// .h files in this project
+#include "buffer.h"
+
+namespace {
+
+/**
+ * @brief free chunks of one thread, a list per size class
+ *
+ * A buffer may be released by another thread than the one which grew it,
+ * the chunk simply moves to the pool of the releasing thread. Each list
+ * keeps at most CACHE_BYTES, the rest goes back to the allocator.
+ */
+class chunk_pool{
+public:
+    static const int CLASSES = 9;                   // 4 KB .. 1 MB
+    static const size_t CACHE_BYTES = 1 << 20;
+
+    ~chunk_pool() {
+        for (auto& list : lists)
+            for (char* chunk : list)
+                ::operator delete(chunk);
+    }
+    char* get(int cls) {
+        auto& list = lists[cls];
+        if (list.empty())
+            return static_cast<char*>(::operator new(buffer::MIN_CHUNK << cls));
+        char* chunk = list.back();
+        list.pop_back();
+        return chunk;
+    }
+    void put(int cls, char* chunk) {
+        auto& list = lists[cls];
+        if ((list.size() + 1) * (buffer::MIN_CHUNK << cls) > CACHE_BYTES)
+            ::operator delete(chunk);
+        else
+            list.push_back(chunk);
+    }
+
+private:
+    std::vector<char*> lists[CLASSES];
+};
+
+thread_local chunk_pool pool;
+
+int size_class(size_t size) {
+    int cls = 0;
+    while ((buffer::MIN_CHUNK << cls) < size)
+        ++cls;
+    return cls;
+}
+
+}
+
+buffer::~buffer() {
+    // only at exit, the pool of this thread may be gone already
+    ::operator delete(chunk);
+}
+
+bool buffer::reserve(size_t n, size_t used) {
+    if (n <= size)
+        return true;
+    if (n > MAX_CHUNK)
+        return false;
+    int cls = size_class(n);
+    char* bigger = pool.get(cls);
+    if (chunk) {
+        memcpy(bigger, chunk, used);
+        pool.put(size_class(size), chunk);
+    }
+    chunk = bigger;
+    size = MIN_CHUNK << cls;
+    return true;
+}
+
+void buffer::release() {
+    if (!chunk)
+        return;
+    pool.put(size_class(size), chunk);
+    chunk = nullptr;
+    size = 0;
+}
@@ -0,0 +1,74 @@
+//
+// Created by tyz on 23-5-23.
+//
+
+// .h files in this project
+#include "conn_table.h"
+
+conn_table* conn_table::Getinstance() {
+    static conn_table instance;
+    return &instance;
+}
+
+conn_table::conn_table() {
+    for (auto& p : pages)
+        p.store(nullptr, std::memory_order_relaxed);
+}
+
+conn_table::~conn_table() {
+    for (auto& p : pages)
+        delete p.load(std::memory_order_relaxed);
+}
+
+http_conn* conn_table::get(int fd) const {
+    if (fd < 0 || fd >= MAX_FD)
+        return nullptr;
+    page* p = pages[fd / PAGE_SIZE].load(std::memory_order_acquire);
+    if (!p)
+        return nullptr;
+    return p->slots[fd % PAGE_SIZE].load(std::memory_order_acquire);
+}
+
+http_conn* conn_table::acquire(int fd) {
+    if (fd < 0 || fd >= MAX_FD)
+        return nullptr;
+    std::atomic<page*>& slot_page = pages[fd / PAGE_SIZE];
+    page* p = slot_page.load(std::memory_order_acquire);
+    if (!p) {
+        // two loops may connect fds of the same page at once, one page wins
+        auto fresh = new page;
+        for (auto& s : fresh->slots)
+            s.store(nullptr, std::memory_order_relaxed);
+        if (slot_page.compare_exchange_strong(p, fresh, std::memory_order_acq_rel))
+            p = fresh;
+        else
+            delete fresh;
+    }
+
+    http_conn* conn;
+    {
+        std::lock_guard<std::mutex> guard1(locker);
+        if (free_conns.empty()) {
+            slabs.emplace_back(new http_conn[SLAB_SIZE]);
+            for (int i = SLAB_SIZE - 1; i >= 0; --i)
+                free_conns.push_back(&slabs.back()[i]);
+        }
+        conn = free_conns.back();
+        free_conns.pop_back();
+    }
+    p->slots[fd % PAGE_SIZE].store(conn, std::memory_order_release);
+    return conn;
+}
+
+void conn_table::unbind(int fd) {
+    if (fd < 0 || fd >= MAX_FD)
+        return;
+    page* p = pages[fd / PAGE_SIZE].load(std::memory_order_acquire);
+    if (p)
+        p->slots[fd % PAGE_SIZE].store(nullptr, std::memory_order_release);
+}
+
+void conn_table::recycle(http_conn* conn) {
+    std::lock_guard<std::mutex> guard1(locker);
+    free_conns.push_back(conn);
+}
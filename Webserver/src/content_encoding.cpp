@@ -0,0 +1,186 @@
+//
+// Created by tyz on 23-5-28.
+//
+
+// C system headers
+#include <strings.h>
+#include <zlib.h>
+#ifdef WEBSERVER_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef WEBSERVER_ZSTD
+#include <zstd.h>
+#endif
+// C++ system headers
+#include <cstring>
+// .h files in this project
+#include "content_encoding.h"
+
+const content_encoding::CODING content_encoding::preference[3] = {CODING_BR, CODING_ZSTD, CODING_GZIP};
+
+namespace {
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+bool equals(std::string_view a, const char* b) {
+    return a.size() == strlen(b) && strncasecmp(a.data(), b, a.size()) == 0;
+}
+
+// q=0, q=0.0, q=0.00 and q=0.000 refuse a coding, anything else takes it
+bool refused(std::string_view params) {
+    while (!params.empty()) {
+        size_t semicolon = params.find(';');
+        std::string_view param = trim(params.substr(0, semicolon));
+        if (param.size() >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+            for (char c : param.substr(2)) {
+                if (c != '0' && c != '.')
+                    return false;
+            }
+            return true;
+        }
+        if (semicolon == std::string_view::npos)
+            break;
+        params.remove_prefix(semicolon + 1);
+    }
+    return false;
+}
+
+bool gzip(const char* data, size_t len, std::string& out) {
+    z_stream stream{};
+    // 15 + 16: a gzip header and trailer instead of zlib's
+    if (deflateInit2(&stream, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    out.resize(deflateBound(&stream, len));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = static_cast<uInt>(len);
+    stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+    int ret = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return ret == Z_STREAM_END;
+}
+
+}
+
+const char* content_encoding::name(CODING coding) {
+    static const char* names[] = {"identity", "gzip", "br", "zstd"};
+    return names[coding];
+}
+
+const char* content_encoding::suffix(CODING coding) {
+    static const char* suffixes[] = {"", ".gz", ".br", ".zst"};
+    return suffixes[coding];
+}
+
+bool content_encoding::can_compress(CODING coding) {
+    switch (coding) {
+        case CODING_GZIP:
+            return true;
+#ifdef WEBSERVER_BROTLI
+        case CODING_BR:
+            return true;
+#endif
+#ifdef WEBSERVER_ZSTD
+        case CODING_ZSTD:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief the codings of an Accept-Encoding header (RFC 7231 5.3.4): those
+ * listed without q=0, and for those not listed, what '*' says
+ */
+unsigned content_encoding::accepted(std::string_view accept_encoding) {
+    unsigned listed = 0, taken = 0;
+    bool star = false;
+    while (!accept_encoding.empty()) {
+        size_t comma = accept_encoding.find(',');
+        std::string_view item = accept_encoding.substr(0, comma);
+        size_t semicolon = item.find(';');
+        std::string_view token = trim(item.substr(0, semicolon));
+        bool ok = semicolon == std::string_view::npos || !refused(item.substr(semicolon + 1));
+        int coding = -1;
+        if (equals(token, "gzip") || equals(token, "x-gzip"))
+            coding = CODING_GZIP;
+        else if (equals(token, "br"))
+            coding = CODING_BR;
+        else if (equals(token, "zstd"))
+            coding = CODING_ZSTD;
+        else if (equals(token, "*"))
+            star = ok;
+        if (coding != -1) {
+            listed |= 1u << coding;
+            if (ok)
+                taken |= 1u << coding;
+        }
+        if (comma == std::string_view::npos)
+            break;
+        accept_encoding.remove_prefix(comma + 1);
+    }
+    if (star)
+        taken |= ~listed & (1u << CODING_GZIP | 1u << CODING_BR | 1u << CODING_ZSTD);
+    return taken;
+}
+
+/**
+ * @brief text, and the formats made of text, compress well. Images, video
+ * and archives are compressed already.
+ */
+bool content_encoding::compressible(std::string_view content_type) {
+    static const char* types[] = {"application/javascript", "application/json", "application/xml",
+                                  "image/svg+xml", "application/wasm"};
+    if (content_type.substr(0, 5) == "text/")
+        return true;
+    for (const char* type : types) {
+        if (content_type == type)
+            return true;
+    }
+    return false;
+}
+
+std::shared_ptr<const std::string> content_encoding::compress(CODING coding, const char* data, size_t len) {
+    auto out = std::make_shared<std::string>();
+    bool ok = false;
+    switch (coding) {
+        case CODING_GZIP:
+            ok = gzip(data, len, *out);
+            break;
+#ifdef WEBSERVER_BROTLI
+        case CODING_BR: {
+            // quality 6: most of the gain of 11 for a fraction of the time
+            size_t size = BrotliEncoderMaxCompressedSize(len);
+            out->resize(size);
+            ok = size && BrotliEncoderCompress(6, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len,
+                                               reinterpret_cast<const uint8_t*>(data), &size,
+                                               reinterpret_cast<uint8_t*>(&(*out)[0]));
+            out->resize(size);
+            break;
+        }
+#endif
+#ifdef WEBSERVER_ZSTD
+        case CODING_ZSTD: {
+            out->resize(ZSTD_compressBound(len));
+            size_t size = ZSTD_compress(&(*out)[0], out->size(), data, len, 6);
+            ok = !ZSTD_isError(size);
+            out->resize(ok ? size : 0);
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+    if (!ok || out->size() > len - len / 8)
+        return nullptr;
+    out->shrink_to_fit();
+    return out;
+}
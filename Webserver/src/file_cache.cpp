@@ -0,0 +1,250 @@
+//
+// Created by tyz on 23-5-22.
+//
+
+// C system headers
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+// C++ system headers
+#include <cstdio>
+// .h files in this project
+#include "config.h"
+#include "file_cache.h"
+
+cached_file::~cached_file() {
+    if (address)
+        munmap(address, file_stat.st_size);
+    close(fd);
+}
+
+file_cache* file_cache::Getinstance() {
+    static file_cache instance;
+    return &instance;
+}
+
+file_cache::file_cache()
+    : bytes(0), budget(config.file_cache_size),
+      response_bytes(0), response_budget(config.response_cache_size),
+      encoded_bytes(0), encoded_budget(config.encoded_cache_size) {
+    notifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notifyfd == -1)
+        printf("inotify_init1 fails, cached files won't be refreshed\n");
+}
+
+file_cache::~file_cache() {
+    if (notifyfd != -1)
+        close(notifyfd);
+}
+
+std::shared_ptr<cached_file> file_cache::lookup(const char* path) {
+    std::lock_guard<std::mutex> guard1(locker);
+    auto it = files.find(path);
+    if (it == files.end())
+        return nullptr;
+    lru.splice(lru.begin(), lru, it->second);
+    return *it->second;
+}
+
+std::shared_ptr<const std::string> file_cache::lookup_response(const std::shared_ptr<cached_file>& file,
+                                                           content_encoding::CODING coding, bool linger) {
+    std::lock_guard<std::mutex> guard1(locker);
+    return file->responses[coding][linger];
+}
+
+/**
+ * @brief keep the serialized response of a cached file, evicting the
+ * responses of the least recently used files if it doesn't fit
+ */
+void file_cache::keep_response(const std::shared_ptr<cached_file>& file, content_encoding::CODING coding,
+                               bool linger, std::shared_ptr<const std::string> response) {
+    if (response->size() > response_budget)
+        return;
+    std::lock_guard<std::mutex> guard1(locker);
+    auto it = files.find(file->path);
+    if (it == files.end() || *it->second != file || file->responses[coding][linger])
+        return;                                     // invalidated meanwhile, or done by another thread
+    response_bytes += response->size();
+    file->responses[coding][linger] = std::move(response);
+    for (auto rit = lru.rbegin(); rit != lru.rend() && response_bytes > response_budget; ++rit) {
+        if (*rit == file)
+            continue;
+        for (auto& by_linger : (*rit)->responses) {
+            for (auto& cached : by_linger) {
+                if (cached) {
+                    response_bytes -= cached->size();
+                    cached.reset();
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief compress the file out of the lock, keep the result in the budget
+ * of the compressed files, evicting those of the least recently used files
+ */
+std::shared_ptr<const std::string> file_cache::encode(const std::shared_ptr<cached_file>& file,
+                                                      content_encoding::CODING coding) {
+    const size_t size = file->file_stat.st_size;
+    if (size > encoded_budget)
+        return nullptr;
+    {
+        std::lock_guard<std::mutex> guard1(locker);
+        if (file->encoded[coding] || file->incompressible & 1u << coding)
+            return file->encoded[coding];
+    }
+    std::shared_ptr<const std::string> encoded;
+    if (file->address) {
+        encoded = content_encoding::compress(coding, file->address, size);
+    } else {
+        std::string data(size, '\0');
+        if (pread(file->fd, &data[0], size, 0) == static_cast<ssize_t>(size))
+            encoded = content_encoding::compress(coding, data.data(), size);
+    }
+    std::lock_guard<std::mutex> guard1(locker);
+    auto it = files.find(file->path);
+    if (it == files.end() || *it->second != file)
+        return encoded;                             // invalidated meanwhile, send it once
+    if (file->encoded[coding])
+        return file->encoded[coding];               // done by another thread
+    if (!encoded) {
+        file->incompressible |= 1u << coding;
+        return nullptr;
+    }
+    encoded_bytes += encoded->size();
+    file->encoded[coding] = encoded;
+    for (auto rit = lru.rbegin(); rit != lru.rend() && encoded_bytes > encoded_budget; ++rit) {
+        if (*rit == file)
+            continue;
+        for (auto& cached : (*rit)->encoded) {
+            if (cached) {
+                encoded_bytes -= cached->size();
+                cached.reset();
+            }
+        }
+    }
+    return encoded;
+}
+
+std::shared_ptr<cached_file> file_cache::insert(const char* path, int fd, const struct stat& st) {
+    if (static_cast<size_t>(st.st_size) > budget || notifyfd == -1)
+        return nullptr;
+    char* address = nullptr;
+    if (config.send_mode == SEND_MMAP && st.st_size > 0) {
+        address = (char *)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED)
+            return nullptr;
+    }
+    auto file = std::make_shared<cached_file>();
+    file->path = path;
+    file->fd = fd;
+    file->file_stat = st;
+    file->address = address;
+    file->siblings = file->incompressible = 0;
+    for (auto coding : content_encoding::preference) {
+        struct stat sibling{};
+        std::string sibling_path = file->path + content_encoding::suffix(coding);
+        if (stat(sibling_path.c_str(), &sibling) == 0 && S_ISREG(sibling.st_mode) && (sibling.st_mode & S_IROTH))
+            file->siblings |= 1u << coding;
+    }
+
+    std::lock_guard<std::mutex> guard1(locker);
+    auto it = files.find(file->path);
+    if (it != files.end())
+        erase(it->second);                          // loaded twice by two threads
+    watch(file->path);
+    lru.push_front(file);
+    files[file->path] = lru.begin();
+    bytes += st.st_size;
+    while (bytes > budget)
+        erase(std::prev(lru.end()));
+    return file;
+}
+
+void file_cache::erase(std::list<std::shared_ptr<cached_file>>::iterator it) {
+    bytes -= (*it)->file_stat.st_size;
+    for (auto& by_linger : (*it)->responses) {
+        for (auto& response : by_linger) {
+            if (response)
+                response_bytes -= response->size();
+        }
+    }
+    for (auto& encoded : (*it)->encoded) {
+        if (encoded)
+            encoded_bytes -= encoded->size();
+    }
+    files.erase((*it)->path);
+    lru.erase(it);
+}
+
+void file_cache::invalidate(const std::string& path) {
+    std::lock_guard<std::mutex> guard1(locker);
+    auto it = files.find(path);
+    if (it != files.end())
+        erase(it->second);
+}
+
+void file_cache::clear() {
+    std::lock_guard<std::mutex> guard1(locker);
+    files.clear();
+    lru.clear();
+    bytes = response_bytes = encoded_bytes = 0;
+}
+
+/**
+ * @brief watch the directory of path, called with locker held
+ */
+void file_cache::watch(const std::string& path) {
+    std::string dir = path.substr(0, path.rfind('/'));
+    if (dir_wds.count(dir))
+        return;
+    int wd = inotify_add_watch(notifyfd, dir.c_str(),
+                               IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                               IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd == -1)
+        return;
+    dir_wds[dir] = wd;
+    wd_dirs[wd] = dir;
+}
+
+void file_cache::handle_events() {
+    alignas(inotify_event) char buf[4096];
+    while (true) {
+        ssize_t len = ::read(notifyfd, buf, sizeof(buf));
+        if (len <= 0)
+            return;                                 // EAGAIN, drained
+        for (char* ptr = buf; ptr < buf + len; ) {
+            auto event = reinterpret_cast<inotify_event*>(ptr);
+            ptr += sizeof(inotify_event) + event->len;
+            if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // lost events or the directory itself is gone
+                clear();
+                std::lock_guard<std::mutex> guard1(locker);
+                auto it = wd_dirs.find(event->wd);
+                if (it != wd_dirs.end()) {
+                    if (event->mask & IN_MOVE_SELF)
+                        inotify_rm_watch(notifyfd, event->wd);
+                    dir_wds.erase(it->second);
+                    wd_dirs.erase(it);
+                }
+                continue;
+            }
+            std::string path;
+            {
+                std::lock_guard<std::mutex> guard1(locker);
+                auto it = wd_dirs.find(event->wd);
+                if (it == wd_dirs.end() || event->len == 0)
+                    continue;
+                path = it->second + "/" + event->name;
+            }
+            invalidate(path);
+            // a sibling appeared, changed or is gone: the file to which it belongs
+            for (auto coding : content_encoding::preference) {
+                std::string suffix = content_encoding::suffix(coding);
+                if (path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0)
+                    invalidate(path.substr(0, path.size() - suffix.size()));
+            }
+        }
+    }
+}
@@ -0,0 +1,91 @@
+//
+// Created by tyz on 23-5-31.
+//
+
+// C system headers
+#include <sys/epoll.h>
+// C++ system headers
+#include <cstring>
+// .h files in this project
+#include "event_loop.h"
+#include "handler.h"
+#include "http_conn.h"
+
+request::request(http_conn& conn, const char* base, const http_parser& parser, const char* url, const route_trie::match& route)
+    : conn(conn), head(base, parser.length), parser(parser),
+      url_offset(url - base), url_length(base + parser.url.offset + parser.url.length - url),
+      path_length(strlen(url)), route(route) {
+    if (path_length < url_length)
+        head[url_offset + path_length] = '?';           // where find_route() cut the url
+}
+
+std::string_view request::param(std::string_view name) const {
+    return http_conn::find_param(route, path(), name);
+}
+
+std::string_view request::header(http_parser::HEADER name) const {
+    const http_header* found = parser.header(name);
+    if (!found)
+        return std::string_view();
+    return http_parser::view(head.data(), found->value);
+}
+
+std::string_view request::header(std::string_view name) const {
+    const http_header* found = parser.header(head.data(), name);
+    if (!found)
+        return std::string_view();
+    return http_parser::view(head.data(), found->value);
+}
+
+request::awaiter request::readable(int fd) {
+    return awaiter(conn, awaiter::WATCH, fd, EPOLLIN);
+}
+
+request::awaiter request::writable(int fd) {
+    return awaiter(conn, awaiter::WATCH, fd, EPOLLOUT);
+}
+
+request::awaiter request::sleep(int ms) {
+    return awaiter(conn, awaiter::SLEEP, ms);
+}
+
+request::awaiter request::read(int fd, char* buf, size_t len, off_t offset) {
+    awaiter wait(conn, awaiter::READ, fd);
+    wait.buf = buf;
+    wait.len = len;
+    wait.offset = offset;
+    return wait;
+}
+
+/**
+ * @brief hand the wait to the loop, which keeps waiter to resume it
+ * @return false if the wait is over already, the coroutine goes on at once
+ */
+bool request::awaiter::await_suspend(std::coroutine_handle<> waiter) {
+    http_conn::suspension& wait = conn.wait;
+    event_loop* loop = conn.get_loop();
+    wait.waiter = waiter;
+    bool suspended;
+    switch (kind) {
+        case WATCH:
+            suspended = loop->watch(&conn, fd, events);
+            break;
+        case SLEEP:
+            suspended = loop->sleep(&conn, fd);
+            break;
+        default:
+            wait.read_fd = fd;
+            wait.buf = buf;
+            wait.len = len;
+            wait.offset = offset;
+            suspended = loop->read_file(&conn);
+            break;
+    }
+    if (!suspended)
+        wait.waiter = nullptr;
+    return suspended;
+}
+
+ssize_t request::awaiter::await_resume() const {
+    return conn.wait.result;
+}
@@ -2,19 +2,30 @@
 // Created by tyz on 23-3-30.
 //
 
+#include "config.h"
+#include "conn_table.h"
 #include "http_conn.h"
-//state information of HTTP response
-const char* ok_200_title = "OK";
-const char* errno_400_title = "BAD_REQUEST";
+#include "reactor.h"
+#include "router.h"
+//bodies of the error responses, their status lines are in header_writer
 const char* errno_400_form = "Your request has bad syntax\n";
-const char* errno_403_title = "Forbidden";
 const char* errno_403_form = "You do not have permission to get file from this server\n";
-const char* errno_404_title = "Not Found";
 const char* errno_404_form = "The request file was not found on this server\n";
-const char* errno_500_title = "Internal Errno";
+const char* errno_405_form = "The method is not allowed for the requested URL\n";
+const char* errno_413_form = "The request body is larger than the server accepts\n";
 const char* errno_500_form = "There was an unusual problem\n";
 // root directory
 const char* doc_root = "/home/tyz/Desktop/C++-learning/linux-highperformance/Webserver/bin";
+// what answers a target of routes, one of them is set
+struct route_target{
+    http_conn::stream_handler stream;
+    http_conn::upload_handler upload;
+    http_conn::coroutine_handler coroutine;
+    std::string dir;                    // files under the prefix, without the last '/'
+};
+// filled before the loops start
+static router routes;
+static std::vector<route_target> targets;
 
 int setnonblock(int sockfd) {
     int old_option = fcntl(sockfd, F_GETFL);
@@ -22,7 +33,7 @@ int setnonblock(int sockfd) {
     return old_option;
 }
 void addfd(int epollfd, int sockfd, bool oneshot) {
-    epoll_event event;
+    epoll_event event{};
     event.data.fd = sockfd;
     event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
     if (oneshot) {
@@ -37,28 +48,99 @@ void removefd(int epollfd, int sockfd) {
 }
 
 void modfd(int epollfd, int sockfd, int ev) {
-    epoll_event event;
+    epoll_event event{};
     event.data.fd = sockfd;
-    event.events = EPOLLIN | EPOLLET | EPOLLRDHUP | ev;
+    // one event at a time, whoever handles it re-arms the fd when done with the conn
+    event.events = EPOLLET | EPOLLRDHUP | EPOLLONESHOT | ev;
     epoll_ctl(epollfd, EPOLL_CTL_MOD, sockfd, &event);
 }
 
-int http_conn::user_count = 0;
-int http_conn::epollfd = -1;
+std::atomic<int> http_conn::user_count(0);
 
+/**
+ * @brief target answers method on pattern
+ */
+static void add_route(const std::string& pattern, http_conn::METHOD method, route_target target) {
+    if (!routes.add(pattern, method, static_cast<int>(targets.size()))) {
+        printf("route %s: malformed, or taken\n", pattern.c_str());
+        return;
+    }
+    targets.push_back(std::move(target));
+}
+
+void http_conn::add_stream(const char* pattern, stream_handler handler) {
+    add_route(pattern, GET, {std::move(handler), nullptr, nullptr, ""});
+}
+
+void http_conn::add_upload(const char* pattern, upload_handler handler) {
+    add_route(pattern, POST, {nullptr, handler, nullptr, ""});
+    add_route(pattern, PUT, {nullptr, std::move(handler), nullptr, ""});
+}
+
+void http_conn::add_handler(const char* pattern, coroutine_handler handler) {
+    add_route(pattern, GET, {nullptr, nullptr, std::move(handler), ""});
+}
+
+void http_conn::add_static(const char* prefix, const char* dir) {
+    std::string pattern = prefix;
+    if (pattern.empty() || pattern.back() != '/')
+        pattern += '/';
+    std::string root = dir;
+    while (root.size() > 1 && root.back() == '/')
+        root.pop_back();
+    if (root.size() >= FILENAME_LEN) {
+        printf("route %s: %s is too long\n", prefix, dir);
+        return;
+    }
+    add_route(pattern + "*", GET, {nullptr, nullptr, nullptr, root});
+}
+
+std::string_view http_conn::find_param(const route_trie::match& route, std::string_view path, std::string_view name) {
+    return routes.param(route, path, name);
+}
+
+std::string_view http_conn::get_param(std::string_view name) const {
+    return routes.param(route, url, name);
+}
+
+/**
+ * @brief close the socket and give this object back to conn_table
+ *
+ * Nothing may touch the object after the call, it can be reused by
+ * another connection at once.
+ */
 void http_conn::close_conn(bool real_close) {
     if (real_close && sockfd != -1) {
-        removefd(epollfd, sockfd);
+        int fd = sockfd;
+        event_loop* loop = owner;
+        end_handler();
         sockfd = -1;
+        unmap();
+        drop_replies();
+        end_body();
+        read_buf.release();
+        write_buf.release();
+        conn_table::Getinstance()->unbind(fd);
+        removefd(epollfd, fd);
         user_count--;
+        if (loop)
+            loop->conn_closed();
+        conn_table::Getinstance()->recycle(this);
     }
 }
 
-void http_conn::init(int fd, const sockaddr_in& adr, tw_timer* timerr) {
+void http_conn::init(int fd, const sockaddr_in& adr, event_loop* loop) {
     sockfd = fd;
     clnt_adr = adr;
-    timer = timerr;
-    addfd(epollfd, fd, true);
+    timer.user_data = this;
+    wait.timer.user_data = this;
+    owner = loop;
+    file_address = nullptr;
+    file_fd = -1;
+    body_pipe[0] = body_pipe[1] = -1;
+    epollfd = loop->get_epollfd();
+    if (epollfd != -1)
+        addfd(epollfd, fd, true);
     user_count++;
 
     init();
@@ -70,51 +152,58 @@ void http_conn::init() {
     method = GET;
     url = nullptr;
     version = nullptr;
-    content_length = 0;
-    host = nullptr;
-    start_line = 0;
-    check_idx = read_idx = write_idx = 0;
-    memset(read_buf, '\0', sizeof(read_buf));
-    memset(write_buf, '\0', sizeof(write_buf));
+    content_length = body_remain = body_received = 0;
+    body_chunked = body_splice = false;
+    chunked.reset();
+    range_count = 0;
+    route.route = -1;
+    coding = content_encoding::CODING_IDENTITY;
+    request_start = 0;
+    parser.reset();
+    check_idx = read_idx = write_idx = head_idx = 0;
+    bytes_to_send = file_remain = 0;
+    reply_count = iv_count = iv_start = 0;
+    send_fd = -1;
+    batch_full = false;
+    stream_ended = stream_polled = false;
+    // an idle connection keeps no buffer
+    read_buf.release();
+    write_buf.release();
     memset(real_file, '\0', sizeof(real_file));
 }
 /**
- * @brief parse a line by changing /r/n -> /0/0
- *
- * @return LINE_STATUS
- */
-http_conn::LINE_STATUS http_conn::parse_line() {
-    char temp;
-    for (; check_idx < read_idx; check_idx++) {
-        temp = read_buf[check_idx];
-        if (temp == '\r') {
-            if (check_idx + 1 == read_idx)
-                return LINE_OPEN;
-            else if (read_buf[check_idx + 1] == '\n') {
-                read_buf[check_idx++] = '\0';
-                read_buf[check_idx++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
-        }
-        else if (temp == '\n') {
-            if (check_idx > 1 && read_buf[check_idx - 1] == '\r') {
-                read_buf[check_idx - 1] = '\0';
-                read_buf[check_idx++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
-        }
+ * @brief make room in read_buf, rebasing the pointers of the parser
+ * @return false if read_buf has reached limit
+ */
+bool http_conn::grow_read_buf(size_t limit) {
+    size_t size = std::max(read_buf.capacity() * 2, buffer::MIN_CHUNK);
+    if (read_buf.capacity() >= limit)
+        return false;
+    char* old = read_buf.data();
+    if (!read_buf.reserve(std::min(size, limit), read_idx))
+        return false;
+    if (old && old != read_buf.data()) {
+        ptrdiff_t delta = read_buf.data() - old;
+        if (url)
+            url += delta;
+        if (version)
+            version += delta;
     }
-    return LINE_OPEN;
+    return true;
 }
 
 bool http_conn::read(){
-    if (read_idx >= READ_BUFFER_SIZE)
-        return false;
     int bytes_read = 0;
+    // the threadpool moves the body from the socket to a file itself
+    if (body_splice)
+        return true;
     while (true) {
-        bytes_read = recv(sockfd, read_buf+read_idx, READ_BUFFER_SIZE-read_idx, 0);
+        // one byte is kept for the '\0' after the request. When read_buf is as
+        // large as it gets, answer what it holds first, prepare() tells whether
+        // a single request is too large
+        if (read_idx + 1 >= static_cast<int>(read_buf.capacity()) && !grow_read_buf(config.max_header_size))
+            break;
+        bytes_read = recv(sockfd, read_buf.data() + read_idx, read_buf.capacity() - 1 - read_idx, 0);
         if (bytes_read == -1) {
             // in most situations, EAGAIN = EWOULDBLOCK except for some old versions of LINUX
             if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -125,35 +214,38 @@ bool http_conn::read(){
             return false;
         }
         read_idx += bytes_read;
+        read_buf[read_idx] = '\0';
     }
     return true;
 }
 
 /**
- * @brief parse the request line
+ * @brief check the request line found by parser
  *
  * @return BAD_REQUEST if fails / NO_REQUEST if successes
  *
  * GET /example.html HTTP/1.1
  * Host: example.com
  */
-http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
-    url = strpbrk(text, " \t");               //search " \t"
-    if (!url)
+http_conn::HTTP_CODE http_conn::parse_request_line() {
+    char* base = read_buf.data() + request_start;
+    const char* method = base + parser.method.offset;
+    static const struct { std::string_view name; METHOD method; } methods[] = {
+        {"GET", GET}, {"POST", POST}, {"PUT", PUT},
+    };
+    auto known = std::find_if(std::begin(methods), std::end(methods), [&](const auto& m) {
+        //ignore upper or lower
+        return m.name.size() == parser.method.length && strncasecmp(method, m.name.data(), m.name.size()) == 0;
+    });
+    if (known == std::end(methods))
         return BAD_REQUEST;
-    *url++ = '\0';
-    char* method = text;
-    if (strcasecmp(method, "GET") != 0) {      //ignore upper or lower
-        return BAD_REQUEST;
-    }
-    this->method = GET;
-    printf("User: %d Method: %s\n", sockfd, method);
-    url += strspn(url, " \t");
-    version = strpbrk(url, " \t");
-    if (!version)
-        return BAD_REQUEST;
-    *version++ = '\0';
-    version += strspn(version, " \t");
+    this->method = known->method;
+    printf("User: %d Method: %.*s\n", sockfd, static_cast<int>(parser.method.length), method);
+    // the byte after them is a space and '\r', the head is consumed anyway
+    url = base + parser.url.offset;
+    url[parser.url.length] = '\0';
+    version = base + parser.version.offset;
+    version[parser.version.length] = '\0';
     if (strcasecmp(version, "HTTP/1.1") != 0)
         return BAD_REQUEST;
     if (strncasecmp(url, "http://", 7) == 0) {
@@ -162,259 +254,1304 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
     }
     if (!url || url[0] != '/')
         return BAD_REQUEST;
-    check_state =  CHECK_STATE_HEADER;
-    printf("Change to state: CHECK_STATE_HEADER\n");
     return NO_REQUEST;
 }
 /**
- * @brief parse headers like 'Connection', 'Host'
- *
- * @return NO_REQUEST if Content is not empty / GET_REQUEST if finishes
- *
+ * @brief read the headers which change how the request is handled, the
+ * others are left to get_header(). Those of the body are start_body()'s.
  */
-http_conn::HTTP_CODE http_conn::parse_headers(char *text) {
-    if (text[0] == '\0') {                // after parse_line(), \r\n -> \0
-        if (content_length != 0) {
-            check_state = CHECK_STATE_CONTENT;
-            printf("Change to state: CHECK_STATE_CONTENT\n");
-            return NO_REQUEST;
+void http_conn::parse_headers() {
+    std::string_view value = get_header(http_parser::HEADER_CONNECTION);
+    if (value.size() == 5 && strncasecmp(value.data(), "close", 5) == 0)
+        linger = false;
+}
+std::string_view http_conn::get_header(http_parser::HEADER name) const {
+    const http_header* header = parser.header(name);
+    if (!header)
+        return std::string_view();
+    return http_parser::view(read_buf.data() + request_start, header->value);
+}
+std::string_view http_conn::get_header(std::string_view name) const {
+    const char* base = read_buf.data() + request_start;
+    const http_header* header = parser.header(base, name);
+    if (!header)
+        return std::string_view();
+    return http_parser::view(base, header->value);
+}
+/**
+ * @brief how the body of the request ends (RFC 9112 6.3), and where it goes:
+ * to the body_sink of an upload, or nowhere for a GET
+ * @return NO_REQUEST if the body is to be read, else the response given
+ * without reading it, after which the connection is closed
+ */
+http_conn::HTTP_CODE http_conn::start_body() {
+    std::string_view encoding = get_header(http_parser::HEADER_TRANSFER_ENCODING);
+    std::string_view length = get_header(http_parser::HEADER_CONTENT_LENGTH);
+    if (encoding.data()) {
+        // with a Content-Length too, or another coding, the end of the body is ambiguous
+        if (length.data() || encoding.size() != 7 || strncasecmp(encoding.data(), "chunked", 7) != 0)
+            return BAD_REQUEST;
+        body_chunked = true;
+    } else if (length.data()) {
+        if (length.empty() || length.size() > 18)
+            return BAD_REQUEST;
+        for (char c : length) {
+            if (c < '0' || c > '9')
+                return BAD_REQUEST;
+            content_length = content_length * 10 + (c - '0');
         }
-        // printf("process file\n");
-        return GET_REQUEST;             // finish
     }
-    else if (strncasecmp(text, "Connection:", 11) == 0) {
-        text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "close") == 0)
-            linger = false;
+    bool has_body = body_chunked || content_length > 0;
+    HTTP_CODE ret = method == GET ? NO_REQUEST : find_upload();
+    if (ret == NO_REQUEST && content_length > config.max_body_size)
+        ret = BODY_TOO_LARGE;
+    if (ret != NO_REQUEST) {
+        end_body();
+        if (has_body)
+            linger = false;                             // where the next request starts is unknown
+        return ret;
     }
-    else if (strncasecmp(text, "Content-Length:", 15) == 0) {
-        text += 15;
-        text += strspn(text, " \t");
-        content_length = atoi(text);
+    body_remain = content_length;
+    // the client may wait for it before sending the body, unless responses are queued before
+    std::string_view expect = get_header(http_parser::HEADER_EXPECT);
+    if (has_body && read_idx == check_idx && reply_count == 0 &&
+        expect.size() == 12 && strncasecmp(expect.data(), "100-continue", 12) == 0) {
+        static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(sockfd, interim, sizeof(interim) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
     }
-    else if (strncasecmp(text, "Host:", 5) == 0) {
-        text += 5;
-        text += strspn(text, " \t");
-        host = text;
+    return NO_REQUEST;
+}
+/**
+ * @brief hand what has arrived of the body to sink, or drop it: only the
+ * head stays in read_buf, so that a body of any size passes through it
+ * @return NO_REQUEST until the body is complete, then the response
+ */
+http_conn::HTTP_CODE http_conn::read_body() {
+    const int head_end = request_start + static_cast<int>(parser.length);
+    const char* data = read_buf.data() + check_idx;
+    size_t received = read_idx - check_idx;
+    bool ok = true, bad = false, done;
+    if (body_chunked) {
+        size_t used = 0;
+        bool refused = false;
+        auto ret = chunked.decode(data, received, used, [&](const char* chunk, size_t len) {
+            refused = !consume_body(chunk, len);
+            return !refused;
+        });
+        check_idx += static_cast<int>(used);
+        ok = ret != chunked_decoder::CHUNKED_BAD;
+        bad = !ok && !refused;                          // the chunks are malformed
+        done = ret == chunked_decoder::CHUNKED_DONE;
+    } else {
+        size_t len = std::min(body_remain, received);
+        ok = len == 0 || consume_body(data, len);
+        check_idx += static_cast<int>(len);
+        body_remain -= len;
+        // the rest goes from the socket straight to the file, on the epoll backend
+        if (ok && body_remain > 0 && sink && epollfd != -1 && sink->splice_fd() != -1)
+            ok = splice_body();
+        done = body_remain == 0;
     }
-    else {
-        printf("Unknown\n");
+    if (!ok) {
+        linger = false;                                 // the rest of the body is never read
+        end_body();
+        if (body_received > config.max_body_size)
+            return BODY_TOO_LARGE;
+        return bad ? BAD_REQUEST : INTERNAL_ERROR;
     }
+    if (done)
+        return sink ? finish_upload() : do_request();
+    int left = read_idx - check_idx;
+    memmove(read_buf.data() + head_end, read_buf.data() + check_idx, left + 1);
+    read_idx = head_end + left;
+    check_idx = head_end;
     return NO_REQUEST;
 }
 /**
- * @brief Actually, we don't care the content.
+ * @brief bytes of the body, to sink if there is one
+ * @return false if the body is too large, or sink refuses it
+ */
+bool http_conn::consume_body(const char* data, size_t len) {
+    body_received += len;
+    if (body_received > config.max_body_size)
+        return false;
+    return !sink || sink->write(data, len);
+}
+/**
+ * @brief move what the socket has of a Content-Length body to the file of
+ * sink through a pipe, the bytes stay in the kernel. Until the body is
+ * complete read() leaves the socket alone, EPOLLIN only wakes us up.
+ * @return false on errors, or if the client is gone
+ */
+bool http_conn::splice_body() {
+    if (body_pipe[0] == -1 && pipe2(body_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        return false;
+    body_splice = true;
+    int fd = sink->splice_fd();
+    while (body_remain > 0) {
+        ssize_t n = splice(sockfd, nullptr, body_pipe[1], nullptr, std::min(body_remain, size_t(SPLICE_CHUNK)),
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return true;
+        if (n <= 0)
+            return false;
+        // the pipe is emptied every time, so EAGAIN above is the socket's
+        for (ssize_t left = n; left > 0;) {
+            ssize_t m = splice(body_pipe[0], nullptr, fd, nullptr, left, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m <= 0)
+                return false;
+            left -= m;
+        }
+        sink->spliced(n);
+        body_received += n;
+        body_remain -= n;
+    }
+    body_splice = false;
+    return true;
+}
+/**
+ * @brief the whole body is in sink, its response is a body_stream
  */
-http_conn::HTTP_CODE http_conn::parse_content(char *text) {
-    if (read_idx >= content_length + check_idx) {
-        text[content_length] = '\0';
-        return GET_REQUEST;
+http_conn::HTTP_CODE http_conn::finish_upload() {
+    stream = sink->finish();
+    end_body();
+    return stream ? STREAM_REQUEST : INTERNAL_ERROR;
+}
+void http_conn::end_body() {
+    sink.reset();
+    if (body_pipe[0] != -1) {
+        close(body_pipe[0]);
+        close(body_pipe[1]);
+        body_pipe[0] = body_pipe[1] = -1;
     }
-    return NO_REQUEST;
+    body_splice = false;
 }
 /**
- * @brief The state machine processes the Send message
- * @return
+ * @brief feed the bytes of the request to parser, then wait for the content
+ * @return NO_REQUEST until the request is complete
  */
 http_conn::HTTP_CODE http_conn::process_read() {
-    LINE_STATUS line_status = LINE_OK;
-    HTTP_CODE ret = NO_REQUEST;
-    char* text = nullptr;
-    while ((check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) ||
-            (line_status = parse_line()) == LINE_OK) {
-        text = get_line();
-        // next line
-        start_line = check_idx;
-        printf("Get 1 http line: %s\n", text);
-
-        switch (check_state) {
-            case CHECK_STATE_REQUESTLINE: {
-                ret = parse_request_line(text);
-                if(ret == BAD_REQUEST)
-                    return BAD_REQUEST;
-                break;
-            }
-            case CHECK_STATE_HEADER: {
-                ret = parse_headers(text);
-                if (ret == GET_REQUEST)
-                    return do_request();
-                break;
-            }
-            case CHECK_STATE_CONTENT: {
-                ret = parse_content(text);
-                if(ret == GET_REQUEST)
-                    return do_request();
-                line_status = LINE_OPEN;
-                break;
-            }
+    if (check_state == CHECK_STATE_REQUESTLINE) {
+        if (read_idx == request_start)
+            return NO_REQUEST;
+        switch (parser.parse(read_buf.data() + request_start, read_idx - request_start)) {
+            case http_parser::PARSE_INCOMPLETE:
+                return NO_REQUEST;
+            case http_parser::PARSE_BAD:
+                return BAD_REQUEST;
             default:
-                return INTERNAL_ERROR;
+                break;
         }
+        check_idx = request_start + static_cast<int>(parser.length);
+        if (parse_request_line() == BAD_REQUEST)
+            return BAD_REQUEST;
+        parse_headers();
+        HTTP_CODE ret = start_body();
+        if (ret != NO_REQUEST)
+            return ret;
+        check_state = CHECK_STATE_CONTENT;
     }
-    return NO_REQUEST;
+    return read_body();
 }
 /**
- * @brief Deal with the file
+ * @brief whether a segment of path is "..", which would lead out of the
+ * directory it is appended to
+ */
+static bool climbs(const char* path) {
+    for (const char* p = strstr(path, "/.."); p; p = strstr(p + 1, "/.."))
+        if (p[3] == '/' || p[3] == '\0')
+            return true;
+    return false;
+}
+/**
+ * @brief drop the empty and "." segments of path in place, so that the
+ * names of a file differing by them are one key of file_cache. ".." is
+ * refused before, symlinks are left as they are
+ */
+static void fold_path(char* path) {
+    char* out = path;
+    for (const char* p = path; *p; ) {
+        if (p[0] == '/' && (p[1] == '/' || (p[1] == '.' && (p[2] == '/' || p[2] == '\0')))) {
+            p += p[1] == '/' ? 1 : 2;
+            continue;
+        }
+        *out++ = *p++;
+    }
+    *out = '\0';
+}
+/**
+ * @brief Hand url to the target of its route, or deal with the file: the
+ * file itself, its precompressed sibling or a compressed variant of it,
+ * whichever Accept-Encoding lets us send
  * @return HTTP_CODE
  */
 http_conn::HTTP_CODE http_conn::do_request() {
-    strcpy(real_file, doc_root);
-    int len = strlen(doc_root);
-    strncpy(real_file+len, url, FILENAME_LEN-len-1);
-    if (stat(real_file, &file_stat) < 0)
+    int target = find_route();
+    const char* root = doc_root;
+    const char* name = url;                             // appended to root
+    if (target != -1) {
+        const route_target& t = targets[target];
+        if (t.stream) {
+            stream = t.stream(*this, url + route.rest);
+            return stream ? STREAM_REQUEST : NO_RESOURCE;
+        }
+        if (t.coroutine)
+            return start_handler(t.coroutine);
+        root = t.dir.c_str();
+        name = url + route.rest - 1;                    // from the '/' ending the prefix
+    } else if (route.route != -1) {
+        return METHOD_NOT_ALLOWED;                      // routed for other methods only
+    }
+    if (climbs(name))
+        return NO_RESOURCE;                             // out of root
+    strcpy(real_file, root);
+    int len = strlen(root);
+    strncpy(real_file+len, name, FILENAME_LEN-len-1);
+    fold_path(real_file + len);                         // the key of file_cache
+    // a conditional or partial request needs the validators, not the stored response
+    bool conditional = is_conditional();
+    bool partial = get_header(http_parser::HEADER_RANGE).data() != nullptr;
+    HTTP_CODE ret = find_file(real_file);
+    if (ret != FILE_REQUEST)
+        return ret;
+    // ranges are of the file as it is
+    coding = partial ? content_encoding::CODING_IDENTITY : negotiate();
+    const char* path = real_file;
+    char sibling[FILENAME_LEN + 8];
+    if (coding != content_encoding::CODING_IDENTITY && !response) {
+        strcpy(sibling, real_file);
+        strcat(sibling, content_encoding::suffix(coding));
+        unmap();
+        if (find_file(sibling) == FILE_REQUEST) {
+            path = sibling;
+        } else {
+            // gone since file_cache looked for it
+            coding = content_encoding::CODING_IDENTITY;
+            ret = find_file(real_file);
+            if (ret != FILE_REQUEST)
+                return ret;
+        }
+    }
+    if (file && !conditional && !partial) {
+        auto whole = file_cache::Getinstance()->lookup_response(file, coding, linger);
+        if (whole) {
+            unmap();
+            response = std::move(whole);
+            return CACHED_REQUEST;
+        }
+    }
+    // nothing to open or map for these, if file_cache doesn't have the file
+    if (conditional && not_modified())
+        return NOT_MODIFIED;
+    if (partial && !parse_ranges())
+        return RANGE_NOT_SATISFIABLE;
+    return open_file(path);
+}
+/**
+ * @brief the route of url in route, the query is cut off url
+ * @return the target answering method there, -1 if none
+ */
+int http_conn::find_route() {
+    // the query is no part of the path: of the route, of a file or of the rest
+    url[strcspn(url, "?")] = '\0';
+    return routes.find(method, url, route);
+}
+/**
+ * @brief the coroutine of a handler, made here and started by the loop once
+ * what precedes it in the batch is out
+ */
+http_conn::HTTP_CODE http_conn::start_handler(const coroutine_handler& start) {
+    req = std::make_unique<request>(*this, read_buf.data() + request_start, parser, url, route);
+    handler = start(*req);
+    if (!handler) {
+        req.reset();
+        return NO_RESOURCE;
+    }
+    wait.waiter = handler.handle();
+    return HANDLER_REQUEST;
+}
+/**
+ * @brief the body_sink of the upload handler of url
+ * @return NO_REQUEST if the body goes to sink, METHOD_NOT_ALLOWED if no
+ * handler takes url
+ */
+http_conn::HTTP_CODE http_conn::find_upload() {
+    int target = find_route();
+    if (target == -1)
+        return METHOD_NOT_ALLOWED;
+    sink = targets[target].upload(*this, url + route.rest);
+    return sink ? NO_REQUEST : NO_RESOURCE;
+}
+/**
+ * @brief file_stat of path, and its cached_file if it fits in file_cache:
+ * a file is cached by its first request, before the response is decided
+ */
+http_conn::HTTP_CODE http_conn::find_file(const char* path) {
+    bool use_cache = config.file_cache_size > 0;
+    if (use_cache && (file = file_cache::Getinstance()->lookup(path))) {
+        file_stat = file->file_stat;
+        return FILE_REQUEST;
+    }
+    if (stat(path, &file_stat) < 0)
         return NO_RESOURCE;
     if(!(file_stat.st_mode & S_IROTH))                  // have the permission?
         return FORBIDDEN_REQUEST;
     if(S_ISDIR(file_stat.st_mode))
         return BAD_REQUEST;
-    int sockfd = open(real_file, O_RDONLY);
+    // a file larger than the whole cache is only opened by open_file()
+    if (use_cache && static_cast<size_t>(file_stat.st_size) <= config.file_cache_size) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return INTERNAL_ERROR;
+        if (!(file = file_cache::Getinstance()->insert(path, fd, file_stat)))
+            close(fd);                                  // open_file() opens it again
+    }
+    return FILE_REQUEST;
+}
+/**
+ * @brief the coding to send: among those Accept-Encoding takes, in the order
+ * the server prefers them, a precompressed sibling, else a variant compressed
+ * here, which is put in response. Only files in file_cache are compressed,
+ * the variants are kept there.
+ */
+content_encoding::CODING http_conn::negotiate() {
+    std::string_view accept = get_header(http_parser::HEADER_ACCEPT_ENCODING);
+    if (!accept.data() || file_stat.st_size == 0)
+        return content_encoding::CODING_IDENTITY;
+    unsigned accepted = content_encoding::accepted(accept);
+    if (!accepted)
+        return content_encoding::CODING_IDENTITY;
+    for (auto c : content_encoding::preference) {
+        if (!(accepted & 1u << c))
+            continue;
+        if (file) {
+            if (file->siblings & 1u << c)
+                return c;
+            continue;
+        }
+        char sibling[FILENAME_LEN + 8];
+        struct stat st{};
+        strcpy(sibling, real_file);
+        strcat(sibling, content_encoding::suffix(c));
+        if (stat(sibling, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IROTH))
+            return c;
+    }
+    size_t size = file_stat.st_size;
+    if (!file || config.encoded_cache_size == 0 || size < content_encoding::MIN_COMPRESS ||
+        size > content_encoding::MAX_COMPRESS || !content_encoding::compressible(content_type()))
+        return content_encoding::CODING_IDENTITY;
+    for (auto c : content_encoding::preference) {
+        if ((accepted & 1u << c) && content_encoding::can_compress(c) &&
+            (response = file_cache::Getinstance()->encode(file, c)))
+            return c;
+    }
+    return content_encoding::CODING_IDENTITY;
+}
+/**
+ * @brief map or open the file found by find_file(), unless file_cache has it
+ */
+http_conn::HTTP_CODE http_conn::open_file(const char* path) {
+    if (file)
+        return use_file();
+    int sockfd = open(path, O_RDONLY | O_CLOEXEC);
+    if (sockfd < 0)
+        return INTERNAL_ERROR;
+    if (config.send_mode == SEND_SENDFILE) {
+        file_fd = sockfd;                               // kept open for sendfile()
+        return FILE_REQUEST;
+    }
     file_address = (char *)mmap(nullptr, file_stat.st_size,
                                 PROT_READ, MAP_PRIVATE, sockfd, 0);
     close(sockfd);
     return FILE_REQUEST;
 }
+http_conn::HTTP_CODE http_conn::use_file() {
+    file_stat = file->file_stat;
+    file_address = file->address;
+    if (config.send_mode == SEND_SENDFILE)
+        file_fd = file->fd;
+    return FILE_REQUEST;
+}
+/**
+ * @brief release the file of the response, mapped or opened for sendfile()
+ */
 void http_conn::unmap() {
+    response.reset();
+    if (file) {
+        // the mapping and the fd belong to file_cache
+        file.reset();
+        file_address = nullptr;
+        file_fd = -1;
+        return;
+    }
     if (file_address) {
         munmap(file_address, file_stat.st_size);
         file_address = nullptr;
     }
+    if (file_fd != -1) {
+        close(file_fd);
+        file_fd = -1;
+    }
 }
+/**
+ * @brief release what the replies of the batch hold, and the batch itself
+ */
+void http_conn::drop_replies() {
+    for (int i = 0; i < reply_count; ++i) {
+        reply& r = replies[i];
+        r.file.reset();
+        r.whole.reset();
+        if (r.mapped)
+            munmap(r.mapped, r.mapped_len);
+        if (r.fd != -1)
+            close(r.fd);
+    }
+    reply_count = 0;
+    write_idx = head_idx = 0;
+    iv_count = iv_start = 0;
+    bytes_to_send = 0;
+    send_fd = -1;
+    file_remain = 0;
+    write_buf.release();
+    if (stream) {
+        // closing its fd would do, unless the stream shares it
+        if (stream_polled && epollfd != -1)
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, stream->wait_fd(), nullptr);
+        stream.reset();
+    }
+    chunk_buf.release();
+    stream_ended = stream_polled = false;
+}
+/**
+ * @brief send iv, then the body of the last reply through sendfile() if it
+ * has one, or chunk by chunk if it is a body_stream, or the response of the
+ * handler answering the last request
+ *
+ * Resumes where the last call stopped when it met EAGAIN, when the
+ * body_stream had nothing more, or when the handler was suspended.
+ */
 bool http_conn::write(){
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = write_idx;
-    if (bytes_to_send == 0) {
+    ssize_t temp = 0;
+    if (bytes_to_send == 0 && !stream && !handler) {
         modfd(epollfd, sockfd, EPOLLIN);
-        init();
         return true;
     }
     while (true) {
-        temp = writev(sockfd, iv, iv_count);
+        if (bytes_to_send <= 0) {
+            // the batch is out, then every chunk of its stream
+            CHUNK next = next_chunk();
+            if (next == CHUNK_READY)
+                continue;
+            if (next == CHUNK_WAIT) {
+                // a suspended handler has had the loop wait already
+                if (stream)
+                    wait_stream();
+                return true;
+            }
+            if (next == CHUNK_ERROR) {
+                drop_replies();
+                return false;
+            }
+            if (!finish())
+                return false;
+            // otherwise the reactor hands the conn to the threadpool again
+            if (!batch_full)
+                modfd(epollfd, sockfd, EPOLLIN);
+            return true;
+        }
+        bool send_iov = bytes_to_send > static_cast<long>(file_remain);
+        if (send_iov)
+            temp = writev(sockfd, get_iov(), get_iov_count());
+        else
+            temp = sendfile(sockfd, send_fd, &file_offset, file_remain);
         if (temp <= -1) {
             if (errno == EAGAIN) {
                 modfd(epollfd, sockfd, EPOLLOUT);
                 return true;
             }
-            unmap();
+            drop_replies();
             return false;
         }
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if (bytes_to_send <= bytes_have_send) {
-            unmap();
-            if (linger) {
-                init();
-                modfd(epollfd, sockfd, EPOLLIN);
-                return true;
-            } else {
-                modfd(epollfd, sockfd, EPOLLIN);
-                return false;
-            }
+        if (temp == 0 && !send_iov) {
+            // the file was truncated since its fstat(), what is promised can't be sent
+            drop_replies();
+            return false;
+        }
+        if (send_iov) {
+            advance(temp);
+        } else {
+            file_remain -= temp;
+            bytes_to_send -= temp;
         }
     }
 }
+/**
+ * @brief the next chunk of stream into iv: "<size in hex>\r\n<data>\r\n",
+ * or the last one, "0\r\n\r\n", once stream has ended
+ *
+ * Called when the socket has taken the previous chunk, so stream is read
+ * only as fast as the client receives.
+ */
+http_conn::CHUNK http_conn::next_chunk() {
+    if (handler)
+        return run_handler();
+    if (!stream || stream_ended)
+        return CHUNK_DONE;
+    if (!chunk_buf.data() && !chunk_buf.reserve(STREAM_CHUNK, 0))
+        return CHUNK_ERROR;
+    char* data = chunk_buf.data() + CHUNK_HEAD;
+    ssize_t n = stream->read(data, chunk_buf.capacity() - CHUNK_HEAD - header_writer::CRLF.size());
+    if (n < 0)
+        return errno == EAGAIN && stream->wait_fd() != -1 ? CHUNK_WAIT : CHUNK_ERROR;
+    iv_count = iv_start = 0;
+    bytes_to_send = 0;
+    if (n == 0) {
+        stream_ended = true;
+        append_iov(header_writer::LAST_CHUNK.data(), header_writer::LAST_CHUNK.size());
+        return CHUNK_READY;
+    }
+    size_t digits = 1;
+    while (static_cast<size_t>(n) >> (4 * digits))
+        ++digits;
+    char* head = data - digits - header_writer::CRLF.size();
+    header_writer(head).hex(n).append(header_writer::CRLF);
+    memcpy(data + n, header_writer::CRLF.data(), header_writer::CRLF.size());
+    append_iov(head, data + n + header_writer::CRLF.size() - head);
+    return CHUNK_READY;
+}
+/**
+ * @brief sleep until the wait_fd() of stream is readable, the socket only
+ * reports a hang up meanwhile. Both are one shot, the same loop handles
+ * them.
+ */
+void http_conn::wait_stream() {
+    epoll_event event{};
+    event.data.u64 = STREAM_EVENT | static_cast<uint32_t>(sockfd);
+    event.events = EPOLLIN | EPOLLONESHOT;
+    epoll_ctl(epollfd, stream_polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, stream->wait_fd(), &event);
+    stream_polled = true;
+    modfd(epollfd, sockfd, 0);
+}
 
-bool http_conn::add_response(const char *format, ...) {
-    if (write_idx >= WRITE_BUFFER_SIZE)
+/**
+ * @brief resume the handler where its wait left it, or start it; once it
+ * has returned, its response replaces the batch, which is out
+ *
+ * Called on the thread of the loop, when the batch is out and whenever the
+ * loop wakes the connection up afterwards.
+ */
+http_conn::CHUNK http_conn::run_handler() {
+    std::coroutine_handle<> next = std::exchange(wait.waiter, nullptr);
+    if (!next)
+        return CHUNK_WAIT;                              // woken up by something else
+    next.resume();
+    if (!handler.done())
+        return CHUNK_WAIT;
+    drop_replies();
+    bool added;
+    try {
+        ::response res = handler.result();
+        added = add_response(res);
+    } catch (const std::exception& e) {
+        printf("User: %d handler failed: %s\n", sockfd, e.what());
+        added = add_error(500, errno_500_form);
+    } catch (...) {
+        added = add_error(500, errno_500_form);
+    }
+    end_handler();
+    if (!added)
+        return CHUNK_ERROR;
+    gather();
+    return CHUNK_READY;
+}
+/**
+ * @brief the head of res, then its body or its stream
+ */
+bool http_conn::add_response(::response& res) {
+    head_idx = write_idx;
+    char* out = head_room(res.content_type.size());
+    if (!out)
         return false;
-    va_list arg_list;
-    va_start(arg_list, format);
-    int len = vsnprintf(write_buf + write_idx, WRITE_BUFFER_SIZE-1-write_idx,
-                        format, arg_list);
-    if (len >= (WRITE_BUFFER_SIZE-1-write_idx))
+    header_writer head(out);
+    head.status(res.status).general().field(header_writer::CONTENT_TYPE, res.content_type);
+    if (res.stream) {
+        // the chunks follow, see next_chunk()
+        head.append(header_writer::CHUNKED).connection(linger).end();
+        write_idx += head.size();
+        stream = std::move(res.stream);
+        queue_reply(nullptr, 0);
+        return true;
+    }
+    head.field(header_writer::CONTENT_LENGTH, res.body.size()).connection(linger).end();
+    write_idx += head.size();
+    response = std::make_shared<const std::string>(std::move(res.body));
+    queue_reply(response->data(), response->size());
+    return true;
+}
+/**
+ * @brief destroy the handler, wherever it is suspended
+ */
+void http_conn::end_handler() {
+    if (!handler)
+        return;
+    owner->forget(this);
+    wait.waiter = nullptr;
+    handler.reset();
+    req.reset();
+}
+/**
+ * @brief room for a head and extra bytes after it at write_idx
+ * @return where to write them, nullptr if the response would be too large
+ */
+char* http_conn::head_room(size_t extra) {
+    size_t need = header_writer::MAX_HEAD + extra;
+    if (need > config.max_header_size || !write_buf.reserve(write_idx + need + 1, write_idx))
+        return nullptr;
+    return write_buf.data() + write_idx;
+}
+/**
+ * @brief a response with form as its body, fields: header lines to add
+ */
+bool http_conn::add_error(int status, const char* form, std::string_view fields) {
+    size_t len = strlen(form);
+    char* out = head_room(len);
+    if (!out)
         return false;
-    write_idx += len;
-    va_end(arg_list);
+    header_writer head(out);
+    head.status(status)
+        .general()
+        .append(fields)
+        .field(header_writer::CONTENT_LENGTH, len)
+        .connection(linger)
+        .end()
+        .append(std::string_view(form, len));
+    write_idx += head.size();
+    queue_reply(nullptr, 0);
     return true;
 }
-bool http_conn::add_status_line(int status, const char *title) {
-    return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+/**
+ * @brief Content-Type by the extension of real_file
+ */
+std::string_view http_conn::content_type() const {
+    static const struct { const char* ext; std::string_view type; } types[] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".txt", "text/plain"},
+        {".css", "text/css"}, {".js", "application/javascript"},
+        {".json", "application/json"}, {".xml", "application/xml"},
+        {".png", "image/png"}, {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"}, {".svg", "image/svg+xml"}, {".ico", "image/x-icon"},
+        {".mp4", "video/mp4"}, {".pdf", "application/pdf"}, {".wasm", "application/wasm"},
+    };
+    const char* ext = strrchr(real_file, '.');
+    if (ext && !strchr(ext, '/')) {
+        for (auto& t : types) {
+            if (strcasecmp(ext, t.ext) == 0)
+                return t.type;
+        }
+    }
+    return "application/octet-stream";
 }
-bool http_conn::add_headers(int content_length) {
-    return add_content_length(content_length) &&
-    add_linger() &&
-    add_blank_line();
+/**
+ * @brief ETag made of the inode, size and mtime of the file, with its quotes
+ * @return its length
+ */
+size_t http_conn::format_etag(char* out) const {
+    header_writer tag(out);
+    tag.append("\"")
+        .hex(file_stat.st_ino).append("-")
+        .hex(file_stat.st_size).append("-")
+        .hex(file_stat.st_mtime);
+    // every representation has its own tag
+    if (coding != content_encoding::CODING_IDENTITY)
+        tag.append("-").append(content_encoding::name(coding));
+    tag.append("\"");
+    return tag.size();
 }
-bool http_conn::add_content_length(int content_length) {
-    return add_response("Content-Length: %d\r\n", content_length);
+void http_conn::add_validators(header_writer& head) const {
+    char tag[ETAG_LEN];
+    // they are those of the representation picked by Accept-Encoding
+    head.append(header_writer::VARY);
+    head.field(header_writer::ETAG, std::string_view(tag, format_etag(tag)))
+        .field_date(header_writer::LAST_MODIFIED, file_stat.st_mtime);
 }
-bool http_conn::add_linger() {
-    return add_response("Connection: %s\r\n", (linger ? "keep-alive" : "close"));
+bool http_conn::is_conditional() const {
+    return get_header(http_parser::HEADER_IF_NONE_MATCH).data() ||
+           get_header(http_parser::HEADER_IF_MODIFIED_SINCE).data();
 }
-bool http_conn::add_blank_line() {
-    return add_response("%s", "\r\n");
+/**
+ * @brief whether the client has the file of file_stat already (RFC 7232 6):
+ * If-None-Match if there is one, by the weak comparison, else If-Modified-Since
+ */
+bool http_conn::not_modified() const {
+    std::string_view match = get_header(http_parser::HEADER_IF_NONE_MATCH);
+    if (match.data()) {
+        char tag[ETAG_LEN];
+        std::string_view etag(tag, format_etag(tag));
+        while (!match.empty()) {
+            size_t comma = match.find(',');
+            std::string_view candidate = match.substr(0, comma);
+            while (!candidate.empty() && (candidate.front() == ' ' || candidate.front() == '\t'))
+                candidate.remove_prefix(1);
+            while (!candidate.empty() && (candidate.back() == ' ' || candidate.back() == '\t'))
+                candidate.remove_suffix(1);
+            if (candidate == "*")
+                return true;
+            if (candidate.substr(0, 2) == "W/")
+                candidate.remove_prefix(2);
+            if (candidate == etag)
+                return true;
+            if (comma == std::string_view::npos)
+                break;
+            match.remove_prefix(comma + 1);
+        }
+        return false;
+    }
+    time_t since;
+    // a date in the future is invalid, and ignored
+    return http_date::parse(get_header(http_parser::HEADER_IF_MODIFIED_SINCE), since) &&
+           since <= time(nullptr) && file_stat.st_mtime <= since;
+}
+/**
+ * @brief the ranges of the Range header, unless If-Range voids it (RFC 7233)
+ * @return false if the header is valid but none of its ranges is satisfiable
+ *
+ * range_count stays 0, the whole file is sent, if the header is invalid or
+ * has more than MAX_RANGES ranges.
+ */
+bool http_conn::parse_ranges() {
+    std::string_view spec = get_header(http_parser::HEADER_RANGE);
+    const off_t size = file_stat.st_size;
+    range_count = 0;
+    if (size == 0 || spec.substr(0, 6) != "bytes=" || !if_range())
+        return true;
+    spec.remove_prefix(6);
+    bool valid = false;
+    while (true) {
+        size_t comma = spec.find(',');
+        std::string_view item = spec.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+            item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+            item.remove_suffix(1);
+        if (!item.empty()) {
+            // first-last, first- or -suffix
+            size_t dash = item.find('-');
+            if (dash == std::string_view::npos || (dash == 0 && item.size() == 1)) {
+                range_count = 0;
+                return true;
+            }
+            off_t numbers[2] = {-1, -1};
+            std::string_view parts[2] = {item.substr(0, dash), item.substr(dash + 1)};
+            for (int i = 0; i < 2; ++i) {
+                if (parts[i].size() > 18) {
+                    range_count = 0;
+                    return true;
+                }
+                for (char c : parts[i]) {
+                    if (c < '0' || c > '9') {
+                        range_count = 0;
+                        return true;
+                    }
+                    numbers[i] = (numbers[i] < 0 ? 0 : numbers[i] * 10) + (c - '0');
+                }
+            }
+            off_t first = numbers[0], last = numbers[1];
+            if (first < 0) {
+                first = size - std::min(last, size);
+                last = size - 1;
+            } else if (last >= 0 && last < first) {
+                range_count = 0;
+                return true;
+            } else if (last < 0 || last >= size) {
+                last = size - 1;
+            }
+            valid = true;
+            if (first < size && first <= last) {
+                if (range_count == MAX_RANGES) {
+                    range_count = 0;
+                    return true;
+                }
+                ranges[range_count++] = byte_range{first, last};
+            }
+        }
+        if (comma == std::string_view::npos)
+            break;
+        spec.remove_prefix(comma + 1);
+    }
+    return range_count > 0 || !valid;
+}
+/**
+ * @brief whether If-Range, if any, names the file of file_stat: by the
+ * strong comparison of its ETag, or by its exact Last-Modified date
+ */
+bool http_conn::if_range() const {
+    std::string_view value = get_header(http_parser::HEADER_IF_RANGE);
+    if (!value.data())
+        return true;
+    if (value.front() == '"') {
+        char tag[ETAG_LEN];
+        return value == std::string_view(tag, format_etag(tag));
+    }
+    time_t date;
+    return http_date::parse(value, date) && date == file_stat.st_mtime;
+}
+/**
+ * @brief 206 of the single range, from the mapping or by sendfile()
+ */
+bool http_conn::add_range() {
+    const byte_range& range = ranges[0];
+    size_t length = range.last - range.first + 1;
+    char* out = head_room(0);
+    if (!out)
+        return false;
+    header_writer head(out);
+    head.status(206).general().field(header_writer::CONTENT_TYPE, content_type());
+    add_validators(head);
+    head.content_range(range.first, range.last, file_stat.st_size)
+        .field(header_writer::CONTENT_LENGTH, length)
+        .connection(linger).end();
+    write_idx += head.size();
+    if (file_fd != -1) {
+        send_fd = file_fd;
+        file_offset = range.first;
+        file_remain = length;
+        queue_reply(nullptr, 0);
+        return true;
+    }
+    queue_reply(file_address + range.first, length);
+    return true;
 }
-bool http_conn::add_content(const char *content) {
-    return add_response("%s", content);
+/**
+ * @brief 206 multipart/byteranges of the ranges, a reply per part
+ *
+ * The parts are sent by writev() from the mapping of the file, which is
+ * mapped here when sendfile() would have been used. Their heads are
+ * counted beforehand for the Content-Length, and may take more than
+ * config.max_header_size: MAX_RANGES bounds them instead.
+ */
+bool http_conn::add_multipart() {
+    if (!file_address) {
+        int fd = file ? file->fd : file_fd;
+        auto address = static_cast<char*>(mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+        if (address == MAP_FAILED)
+            return false;
+        if (file)
+            file.reset();                               // its fd isn't needed any more
+        else
+            close(file_fd);
+        file_fd = -1;
+        file_address = address;
+    }
+    static std::atomic<uint64_t> boundaries(static_cast<uint64_t>(time(nullptr)) << 20);
+    const uint64_t boundary = boundaries.fetch_add(1, std::memory_order_relaxed);
+    const std::string_view type = content_type();
+    const size_t boundary_len = header_writer::number_length(boundary);
+    const size_t size_len = header_writer::number_length(file_stat.st_size);
+    // "\r\n--<boundary>\r\nContent-Type: <type>\r\nContent-Range: bytes <first>-<last>/<size>\r\n\r\n"
+    size_t heads = 0, body = 0;
+    for (int i = 0; i < range_count; ++i) {
+        heads += 4 + boundary_len + 2 + header_writer::CONTENT_TYPE.size() + type.size() + 2 +
+                 header_writer::CONTENT_RANGE.size() + header_writer::number_length(ranges[i].first) + 1 +
+                 header_writer::number_length(ranges[i].last) + 1 + size_len + 4;
+        body += ranges[i].last - ranges[i].first + 1;
+    }
+    const size_t closing = 4 + boundary_len + 4;        // "\r\n--<boundary>--\r\n"
+    if (!write_buf.reserve(write_idx + header_writer::MAX_HEAD + heads + closing + 1, write_idx))
+        return false;
+
+    header_writer head(write_buf.data() + write_idx);
+    head.status(206).general()
+        .append(header_writer::CONTENT_TYPE).append("multipart/byteranges; boundary=").number(boundary)
+        .append(header_writer::CRLF);
+    add_validators(head);
+    head.field(header_writer::CONTENT_LENGTH, heads + body + closing).connection(linger).end();
+    size_t part_begin = head_idx;
+    for (int i = 0; i < range_count; ++i) {
+        const byte_range& range = ranges[i];
+        head.append("\r\n--").number(boundary).append(header_writer::CRLF)
+            .field(header_writer::CONTENT_TYPE, type)
+            .content_range(range.first, range.last, file_stat.st_size)
+            .append(header_writer::CRLF);
+        write_idx = head_idx + head.size();
+        queue_part(part_begin, file_address + range.first, range.last - range.first + 1);
+        part_begin = write_idx;
+    }
+    head.append("\r\n--").number(boundary).append("--\r\n");
+    write_idx = head_idx + head.size();
+    head_idx = part_begin;
+    queue_reply(nullptr, 0);                            // owns the mapping of the parts
+    return true;
 }
+/**
+ * @brief append the response to ret to the batch
+ */
 bool http_conn::process_write(HTTP_CODE ret) {
+    head_idx = write_idx;
     switch (ret) {
-        case INTERNAL_ERROR: {
-            add_status_line(500, errno_500_title);
-            add_headers(strlen(errno_500_form));
-            if (!add_content(errno_500_form))
+        case INTERNAL_ERROR:
+            return add_error(500, errno_500_form);
+        case BAD_REQUEST:
+            // where the request ends is unknown, and so where the next one starts
+            linger = false;
+            return add_error(400, errno_400_form);
+        case NO_RESOURCE:
+            return add_error(404, errno_404_form);
+        case FORBIDDEN_REQUEST:
+            return add_error(403, errno_403_form);
+        case METHOD_NOT_ALLOWED: {
+            // what the route of url has targets for, files only have GET
+            static const char* names[] = {"GET", "POST", "HEAD", "PUT", "DELETE",
+                                          "TRACE", "OPTIONS", "CONNECT", "PATCH"};
+            unsigned methods = route.route != -1 ? routes.methods(route.route) : 1u << GET;
+            std::string allow = "Allow:";
+            for (int m = GET; m <= PATCH; ++m) {
+                if (methods & 1u << m)
+                    allow.append(allow.size() > 6 ? ", " : " ").append(names[m]);
+            }
+            allow += "\r\n";
+            return add_error(405, errno_405_form, allow);
+        }
+        case BODY_TOO_LARGE:
+            return add_error(413, errno_413_form);
+        case CACHED_REQUEST: {
+            // one buffer holds the whole response, but for a fresh status line and Date
+            size_t stale = header_writer::status_line(200).size() + http_date::LEN;
+            char* out = head_room(0);
+            if (!out)
                 return false;
-            break;
+            header_writer head(out);
+            head.status(200).date();
+            write_idx += head.size();
+            queue_reply(response->data() + stale, response->size() - stale);
+            return true;
         }
-        case BAD_REQUEST: {
-            add_status_line(400, errno_400_title);
-            add_headers(strlen(errno_400_form));
-            if (!add_content(errno_400_form))
+        case NOT_MODIFIED: {
+            char* out = head_room(0);
+            if (!out)
                 return false;
-            break;
+            header_writer head(out);
+            head.status(304).general();
+            add_validators(head);
+            head.connection(linger).end();
+            write_idx += head.size();
+            queue_reply(nullptr, 0);
+            return true;
         }
-        case NO_RESOURCE: {
-            add_status_line(404, errno_404_title);
-            add_headers(strlen(errno_404_form));
-            if (!add_content(errno_404_form))
+        case RANGE_NOT_SATISFIABLE: {
+            char* out = head_room(0);
+            if (!out)
                 return false;
-            break;
+            header_writer head(out);
+            head.status(416).general()
+                .append(header_writer::CONTENT_RANGE).append("*/").number(file_stat.st_size).append(header_writer::CRLF)
+                .field(header_writer::CONTENT_LENGTH, uint64_t(0))
+                .connection(linger).end();
+            write_idx += head.size();
+            queue_reply(nullptr, 0);
+            return true;
         }
-        case FORBIDDEN_REQUEST: {
-            add_status_line(403, errno_403_title);
-            add_headers(strlen(errno_403_form));
-            if (!add_content(errno_403_form))
+        case HANDLER_REQUEST:
+            // its response is built once it returns, see run_handler()
+            return true;
+        case STREAM_REQUEST: {
+            // the chunks follow the batch, see next_chunk(). The type is the handler's, of any length
+            char* out = head_room(stream->content_type().size());
+            if (!out)
                 return false;
-            break;
+            header_writer head(out);
+            head.status(stream->status()).general()
+                .field(header_writer::CONTENT_TYPE, stream->content_type())
+                .append(header_writer::CHUNKED)
+                .connection(linger).end();
+            write_idx += head.size();
+            queue_reply(nullptr, 0);
+            return true;
         }
         case FILE_REQUEST: {
-            add_status_line(200, ok_200_title);
-            if (file_stat.st_size != 0) {
-                add_headers(file_stat.st_size);
-                iv[0].iov_base = write_buf;
-                iv[0].iov_len = write_idx;
-                iv[1].iov_base = file_address;
-                iv[1].iov_len = file_stat.st_size;
-                iv_count = 2;
+            if (range_count == 1)
+                return add_range();
+            if (range_count > 1)
+                return add_multipart();
+            const std::string_view empty = "<html><body></body></html>";
+            char* out = head_room(empty.size());
+            if (!out)
+                return false;
+            header_writer head(out);
+            head.status(200).general().field(header_writer::CONTENT_TYPE, content_type());
+            if (coding != content_encoding::CODING_IDENTITY)
+                head.field(header_writer::CONTENT_ENCODING, content_encoding::name(coding));
+            add_validators(head);
+            if (coding == content_encoding::CODING_IDENTITY)
+                head.append(header_writer::ACCEPT_RANGES);
+            if (file_stat.st_size == 0) {
+                head.field(header_writer::CONTENT_LENGTH, empty.size()).connection(linger).end().append(empty);
+                write_idx += head.size();
+                queue_reply(nullptr, 0);
                 return true;
-            } else {
-                const char* ok_string = "<html><body></body></html>";
-                add_headers(strlen(ok_string));
-                if (!add_content(ok_string))
-                    return false;
             }
+            // response: the variant compressed here
+            size_t body_len = response ? response->size() : file_stat.st_size;
+            head.field(header_writer::CONTENT_LENGTH, body_len).connection(linger).end();
+            write_idx += head.size();
+            keep_response();
+            if (response) {
+                queue_reply(response->data(), body_len);
+                return true;
+            }
+            if (file_fd != -1) {
+                // the body goes through sendfile() once the headers are out
+                send_fd = file_fd;
+                file_offset = 0;
+                file_remain = file_stat.st_size;
+                queue_reply(nullptr, 0);
+                return true;
+            }
+            queue_reply(file_address, file_stat.st_size);
+            return true;
         }
         default:
             return false;
     }
-    iv[0].iov_base = write_buf;
-    iv[0].iov_len = write_idx;
-    iv_count = 1;
-    return true;
+}
+/**
+ * @brief the response built from head_idx is complete, move the file of the
+ * request to it: the next request of the batch needs the members
+ */
+void http_conn::queue_reply(const char* body, size_t body_len) {
+    reply& r = replies[reply_count++];
+    r.head_begin = head_idx;
+    r.head_end = write_idx;
+    r.body = body;
+    r.body_len = body_len;
+    r.whole = std::move(response);
+    r.mapped = nullptr;
+    r.fd = -1;
+    if (file) {
+        r.file = std::move(file);                       // owns the mapping and the fd
+    } else {
+        r.mapped = file_address;
+        r.mapped_len = file_stat.st_size;
+        r.fd = file_fd;
+    }
+    file_address = nullptr;
+    file_fd = -1;
+}
+/**
+ * @brief a part of the response being built, its head from head_begin to
+ * write_idx: what body points to is kept alive by the reply queued after it
+ */
+void http_conn::queue_part(size_t head_begin, const char* body, size_t body_len) {
+    reply& r = replies[reply_count++];
+    r.head_begin = head_begin;
+    r.head_end = write_idx;
+    r.body = body;
+    r.body_len = body_len;
+    r.mapped = nullptr;
+    r.fd = -1;
+}
+/**
+ * @brief point iv at the batch, once write_buf won't move any more
+ *
+ * Heads which follow each other in write_buf share an entry.
+ */
+void http_conn::gather() {
+    iv_count = iv_start = 0;
+    bytes_to_send = static_cast<long>(file_remain);
+    for (int i = 0; i < reply_count; ++i) {
+        const reply& r = replies[i];
+        append_iov(write_buf.data() + r.head_begin, r.head_end - r.head_begin);
+        append_iov(r.body, r.body_len);
+    }
+}
+void http_conn::append_iov(const char* data, size_t len) {
+    if (len == 0)
+        return;
+    bytes_to_send += static_cast<long>(len);
+    if (iv_count > 0) {
+        iovec& last = iv[iv_count - 1];
+        if (static_cast<char*>(last.iov_base) + last.iov_len == data) {
+            last.iov_len += len;
+            return;
+        }
+    }
+    iv[iv_count].iov_base = const_cast<char*>(data);
+    iv[iv_count].iov_len = len;
+    ++iv_count;
+}
+/**
+ * @brief keep the whole response of a small cached file, headers are in write_buf.
+ * Its status line and Date are written again when it is used.
+ */
+void http_conn::keep_response() {
+    size_t body = response ? response->size() : file_stat.st_size;
+    if (!file || body > config.small_file_size || config.response_cache_size == 0)
+        return;
+    size_t head = write_idx - head_idx;
+    auto whole = std::make_shared<std::string>(write_buf.data() + head_idx, head);
+    whole->resize(head + body);
+    if (response)
+        memcpy(&(*whole)[head], response->data(), body);
+    else if (file->address)
+        memcpy(&(*whole)[head], file->address, body);
+    else if (pread(file->fd, &(*whole)[head], body, 0) != static_cast<ssize_t>(body))
+        return;
+    file_cache::Getinstance()->keep_response(file, coding, linger, std::move(whole));
 }
 /**
  * @brief entry function. Threads invoke this.
  */
 void http_conn::process() {
-    HTTP_CODE read_ret = process_read();
+    // the count drops before the re-arm: once the fd is armed, the reactor may
+    // close the conn and hand the object to another one. Until then it doesn't
+    // see the fd, and the timer doesn't close a conn which was just read
+    int sock = sockfd;
+    int epfd = epollfd;
+    if (wait.read_fd != -1) {
+        // the read of a handler, which the writable socket wakes up on the reactor
+        ssize_t n = pread(wait.read_fd, wait.buf, wait.len, wait.offset);
+        wait.result = n < 0 ? -errno : n;
+        wait.read_fd = -1;
+        tasks.fetch_sub(1, std::memory_order_release);
+        modfd(epfd, sock, EPOLLOUT);
+        return;
+    }
+    HTTP_CODE read_ret = prepare();
+    tasks.fetch_sub(1, std::memory_order_release);
     if (read_ret == NO_REQUEST) {
-        modfd(epollfd, sockfd, EPOLLIN);
+        modfd(epfd, sock, EPOLLIN);
+    } else if (read_ret == CLOSED_CONNECTION) {
+        // the reactor closes it on EPOLLHUP, the timer and the slot are its business
+        shutdown(sock, SHUT_RDWR);
+        modfd(epfd, sock, EPOLLOUT);
+    } else {
+        modfd(epfd, sock, EPOLLOUT);
+    }
+}
+/**
+ * @brief append bytes which the caller has received from the socket
+ *
+ * Unlike read(), the caller can't leave them in the socket until the
+ * requests before them are answered, so pipelined requests may take up to
+ * buffer::MAX_CHUNK. prepare() still refuses a request larger than
+ * config.max_header_size.
+ * @return false if read_buf is full
+ */
+bool http_conn::fill(const char* data, int len) {
+    while (read_idx + len + 1 > static_cast<int>(read_buf.capacity())) {
+        if (!grow_read_buf(buffer::MAX_CHUNK))
+            return false;
+    }
+    memcpy(read_buf.data() + read_idx, data, len);
+    read_idx += len;
+    read_buf[read_idx] = '\0';
+    return true;
+}
+/**
+ * @brief answer every complete request in read_buf, pipelined ones included,
+ * with one batch of at most MAX_PIPELINE responses
+ * @return NO_REQUEST if no request is complete / CLOSED_CONNECTION if a
+ * response can't be built or a request doesn't fit in read_buf / otherwise
+ * iv holds the batch
+ */
+http_conn::HTTP_CODE http_conn::prepare() {
+    HTTP_CODE ret = NO_REQUEST;
+    batch_full = false;
+    while (true) {
+        // a sendfile() body, a stream or a handler has to be the last, and the next head has to fit
+        if (reply_count >= MAX_PIPELINE || send_fd != -1 || stream || handler ||
+            write_idx + config.max_header_size > buffer::MAX_CHUNK) {
+            batch_full = read_idx > request_start;
+            break;
+        }
+        HTTP_CODE read_ret = process_read();
+        if (read_ret == NO_REQUEST)
+            break;
+        if (!process_write(read_ret)) {
+            unmap();
+            drop_replies();
+            return CLOSED_CONNECTION;
+        }
+        ret = read_ret;
+        if (!linger)
+            break;                                      // nothing after it is answered
+        next_request();
+    }
+    compact();
+    if (reply_count == 0 && !handler)
+        return read_idx + 1 >= static_cast<int>(config.max_header_size) ? CLOSED_CONNECTION : NO_REQUEST;
+    gather();
+    return ret;
+}
+/**
+ * @brief forget the request just answered, the bytes after it start the next one
+ */
+void http_conn::next_request() {
+    check_state = CHECK_STATE_REQUESTLINE;
+    linger = true;
+    method = GET;
+    url = version = nullptr;
+    content_length = body_remain = body_received = 0;
+    body_chunked = false;
+    chunked.reset();
+    end_body();
+    range_count = 0;
+    coding = content_encoding::CODING_IDENTITY;
+    parser.reset();
+    request_start = check_idx;
+}
+/**
+ * @brief move the bytes of the unanswered requests to the front of read_buf,
+ * release it if there are none
+ */
+void http_conn::compact() {
+    int left = read_idx - request_start;
+    if (left == 0) {
+        read_buf.release();
+        read_idx = check_idx = request_start = 0;
         return;
     }
-    bool write_ret = process_write(read_ret);
-    if (!write_ret) {
-        close_conn();
+    if (request_start == 0)
+        return;
+    char* base = read_buf.data();
+    memmove(base, base + request_start, left + 1);     // with the '\0' after them
+    if (url)
+        url -= request_start;
+    if (version)
+        version -= request_start;
+    read_idx -= request_start;
+    check_idx -= request_start;
+    request_start = 0;
+}
+/**
+ * @brief consume bytes_sent bytes of iv
+ * @return true if the whole batch has been sent
+ */
+bool http_conn::advance(size_t bytes_sent) {
+    bytes_to_send -= static_cast<long>(bytes_sent);
+    while (iv_start < iv_count && bytes_sent >= iv[iv_start].iov_len) {
+        bytes_sent -= iv[iv_start].iov_len;
+        ++iv_start;
+    }
+    if (iv_start < iv_count) {
+        iv[iv_start].iov_base = static_cast<char*>(iv[iv_start].iov_base) + bytes_sent;
+        iv[iv_start].iov_len -= bytes_sent;
+    }
+    return iv_start == iv_count;
+}
+/**
+ * @brief the batch has been sent, the requests after it stay in read_buf
+ * @return true if the connection stays alive
+ */
+bool http_conn::finish() {
+    drop_replies();
+    if (!linger) {
+        // the socket inherits the abortive SO_LINGER of the listener, whose RST
+        // would drop what the peer hasn't received of the batch yet
+        struct linger graceful = {0, 0};
+        setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &graceful, sizeof(graceful));
     }
-    modfd(epollfd, sockfd, EPOLLOUT);
+    return linger;
 }
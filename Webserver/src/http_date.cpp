@@ -0,0 +1,123 @@
+//
+// Created by tyz on 23-5-27.
+//
+
+// C++ system headers
+#include <cstring>
+#include <string>
+// .h files in this project
+#include "http_date.h"
+
+char http_date::lines[SLOTS][LEN];
+std::atomic<int> http_date::published(0);
+std::atomic<time_t> http_date::second(-1);
+
+namespace {
+
+const char days[] = "SunMonTueWedThuFriSat";
+const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+inline char* two_digits(char* p, int n) {
+    *p++ = static_cast<char>('0' + n / 10);
+    *p++ = static_cast<char>('0' + n % 10);
+    return p;
+}
+
+// of two digits at p, -1 if they aren't
+inline int number(const char* p) {
+    if (p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9')
+        return -1;
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+// so that a head written before the first refresh() has a Date too
+struct first_refresh{
+    first_refresh() { http_date::refresh(); }
+} at_start;
+
+}
+
+void http_date::refresh() {
+    time_t now = time(nullptr);
+    time_t last = second.load(std::memory_order_relaxed);
+    // several loops may refresh at once, one of them formats
+    if (now == last || !second.compare_exchange_strong(last, now, std::memory_order_relaxed))
+        return;
+    int slot = (published.load(std::memory_order_relaxed) + 1) % SLOTS;
+    char* p = lines[slot];
+    memcpy(p, "Date: ", 6);
+    format(p + 6, now);
+    memcpy(p + 6 + DATE_LEN, "\r\n", 2);
+    published.store(slot, std::memory_order_release);
+}
+
+/**
+ * @brief IMF-fixdate of RFC 7231, without strftime() which follows the locale
+ */
+void http_date::format(char* out, time_t t) {
+    tm gmt{};
+    gmtime_r(&t, &gmt);
+    char* p = out;
+    memcpy(p, days + gmt.tm_wday * 3, 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p = two_digits(p, gmt.tm_mday);
+    *p++ = ' ';
+    memcpy(p, months + gmt.tm_mon * 3, 3);
+    p += 3;
+    *p++ = ' ';
+    int year = gmt.tm_year + 1900;
+    p = two_digits(p, year / 100);
+    p = two_digits(p, year % 100);
+    *p++ = ' ';
+    p = two_digits(p, gmt.tm_hour);
+    *p++ = ':';
+    p = two_digits(p, gmt.tm_min);
+    *p++ = ':';
+    p = two_digits(p, gmt.tm_sec);
+    memcpy(p, " GMT", 4);
+}
+
+/**
+ * @brief IMF-fixdate by its fixed positions, the obsolete RFC 850 and
+ * asctime() formats by strptime()
+ */
+bool http_date::parse(std::string_view text, time_t& t) {
+    tm gmt{};
+    if (text.size() == DATE_LEN && text[3] == ',' && text.substr(25) == " GMT") {
+        const char* p = text.data();
+        int fields[] = {number(p + 5), number(p + 12), number(p + 14),
+                        number(p + 17), number(p + 20), number(p + 23)};
+        int month = 0;
+        while (month < 12 && memcmp(p + 8, months + month * 3, 3) != 0)
+            ++month;
+        for (int f : fields) {
+            if (f < 0)
+                return false;
+        }
+        if (month == 12 || fields[0] < 1 || fields[0] > 31)
+            return false;
+        gmt.tm_mday = fields[0];
+        gmt.tm_mon = month;
+        gmt.tm_year = fields[1] * 100 + fields[2] - 1900;
+        gmt.tm_hour = fields[3];
+        gmt.tm_min = fields[4];
+        gmt.tm_sec = fields[5];
+    } else {
+        std::string copy(text);
+        const char* end = strptime(copy.c_str(), "%A, %d-%b-%y %H:%M:%S GMT", &gmt);
+        if (!end || *end) {
+            gmt = tm{};
+            end = strptime(copy.c_str(), "%a %b %e %H:%M:%S %Y", &gmt);
+        }
+        if (!end || *end)
+            return false;
+    }
+    t = timegm(&gmt);
+    return t != -1;
+}
+
+void http_date::copy(char* out) {
+    memcpy(out, lines[published.load(std::memory_order_acquire)], LEN);
+}
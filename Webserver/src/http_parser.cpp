@@ -0,0 +1,291 @@
+//
+// Created by tyz on 23-5-26.
+//
+
+// C system headers
+#include <immintrin.h>
+#include <strings.h>
+// C++ system headers
+#include <cstring>
+#include <string_view>
+// .h files in this project
+#include "http_parser.h"
+
+namespace {
+
+// first byte of [p, end) which is a, b or c, end if there is none
+typedef const char* (*find_fn)(const char* p, const char* end, char a, char b, char c);
+
+const char* find_scalar(const char* p, const char* end, char a, char b, char c) {
+    for (; p < end; ++p) {
+        if (*p == a || *p == b || *p == c)
+            return p;
+    }
+    return end;
+}
+
+__attribute__((target("sse4.2")))
+const char* find_sse42(const char* p, const char* end, char a, char b, char c) {
+    const __m128i set = _mm_setr_epi8(a, b, c, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int i = _mm_cmpestri(set, 3, block, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16)
+            return p + i;
+        p += 16;
+    }
+    return find_scalar(p, end, a, b, c);
+}
+
+__attribute__((target("avx2")))
+const char* find_avx2(const char* p, const char* end, char a, char b, char c) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, va),
+                                                      _mm256_cmpeq_epi8(block, vb)),
+                                      _mm256_cmpeq_epi8(block, vc));
+        auto mask = static_cast<unsigned>(_mm256_movemask_epi8(hit));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    if (end - p >= 16) {
+        // short lines are common, don't leave up to 31 bytes to the scalar loop
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(va)),
+                                                _mm_cmpeq_epi8(block, _mm256_castsi256_si128(vb))),
+                                   _mm_cmpeq_epi8(block, _mm256_castsi256_si128(vc)));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_scalar(p, end, a, b, c);
+}
+
+bool supported(http_parser::ISA isa) {
+    __builtin_cpu_init();
+    switch (isa) {
+        case http_parser::ISA_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case http_parser::ISA_SSE42:
+            return __builtin_cpu_supports("sse4.2");
+        default:
+            return true;
+    }
+}
+
+http_parser::ISA best() {
+    if (supported(http_parser::ISA_AVX2))
+        return http_parser::ISA_AVX2;
+    if (supported(http_parser::ISA_SSE42))
+        return http_parser::ISA_SSE42;
+    return http_parser::ISA_SCALAR;
+}
+
+find_fn kernel(http_parser::ISA isa) {
+    switch (isa) {
+        case http_parser::ISA_AVX2:
+            return find_avx2;
+        case http_parser::ISA_SSE42:
+            return find_sse42;
+        default:
+            return find_scalar;
+    }
+}
+
+http_parser::ISA current = best();
+find_fn find = kernel(current);
+
+// in the order of http_parser::HEADER
+constexpr const char* header_names[http_parser::HEADER_COUNT] = {
+        "Accept", "Accept-Charset", "Accept-Encoding", "Accept-Language", "Authorization",
+        "Cache-Control", "Connection", "Content-Encoding", "Content-Length", "Content-Type",
+        "Cookie", "Date", "Expect", "Host", "If-Match", "If-Modified-Since", "If-None-Match",
+        "If-Range", "If-Unmodified-Since", "Keep-Alive", "Origin", "Pragma", "Range",
+        "Referer", "Transfer-Encoding", "Upgrade", "User-Agent"};
+const size_t MAX_NAME_LEN = 19;         // If-Unmodified-Since
+
+/**
+ * @brief slot of a name in the 64 of slots: (length, first, last letter) are
+ * distinct for the known names, the multiplier spreads them without
+ * collision (checked by the build, see slots). A letter | 0x20 is its lower
+ * case.
+ */
+constexpr unsigned hash(const char* name, size_t len) {
+    uint32_t key = static_cast<uint32_t>(len) | (name[0] | 0x20u) << 8 | (name[len - 1] | 0x20u) << 16;
+    return (key * 0x27b0382du) >> 26;
+}
+
+struct header_slots{
+    int8_t slot[64];                    // HEADER of the name there, -1 if none
+    bool perfect;                       // no two names hash to a slot
+};
+
+constexpr header_slots make_slots() {
+    header_slots s{};
+    for (int8_t& h : s.slot)
+        h = -1;
+    s.perfect = true;
+    for (int h = 0; h < http_parser::HEADER_COUNT; ++h) {
+        unsigned i = hash(header_names[h], std::string_view(header_names[h]).size());
+        if (s.slot[i] != -1)
+            s.perfect = false;
+        s.slot[i] = static_cast<int8_t>(h);
+    }
+    return s;
+}
+constexpr header_slots slots = make_slots();
+static_assert(slots.perfect, "two known header names hash to a slot, change the multiplier of hash()");
+
+inline bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+inline http_slice slice(const char* base, const char* from, const char* to) {
+    return http_slice{static_cast<uint32_t>(from - base), static_cast<uint32_t>(to - from)};
+}
+
+}
+
+http_parser::ISA http_parser::isa() {
+    return current;
+}
+
+const char* http_parser::isa_name(ISA isa) {
+    static const char* names[] = {"scalar", "sse4.2", "avx2"};
+    return names[isa];
+}
+
+bool http_parser::use(ISA isa) {
+    if (!supported(isa))
+        return false;
+    current = isa;
+    find = kernel(isa);
+    return true;
+}
+
+http_parser::HEADER http_parser::lookup(const char* name, size_t len) {
+    if (len == 0 || len > MAX_NAME_LEN)
+        return HEADER_OTHER;
+    int h = slots.slot[hash(name, len)];
+    if (h == -1 || header_names[h][len] != '\0' || strncasecmp(name, header_names[h], len) != 0)
+        return HEADER_OTHER;
+    return static_cast<HEADER>(h);
+}
+
+const char* http_parser::header_name(HEADER h) {
+    return h < HEADER_COUNT ? header_names[h] : "";
+}
+
+const http_header* http_parser::header(const char* base, std::string_view name) const {
+    HEADER h = lookup(name.data(), name.size());
+    if (h != HEADER_OTHER)
+        return header(h);
+    for (int i = 0; i < header_count; ++i) {
+        const http_header& other = headers[i];
+        if (other.name.length == name.size() && strncasecmp(base + other.name.offset, name.data(), name.size()) == 0)
+            return &other;
+    }
+    return nullptr;
+}
+
+void http_parser::reset() {
+    method = url = version = http_slice{0, 0};
+    header_count = 0;
+    memset(known, 0, sizeof(known));
+    length = scan = colon = 0;
+    in_headers = false;
+}
+
+/**
+ * @brief parse the lines completed since the last call
+ *
+ * A line ends with "\r\n", a bare '\n' or '\r' is refused. Header lines
+ * without ':' are skipped. A known name repeated keeps its first header in
+ * known[], the table has them all.
+ */
+http_parser::RESULT http_parser::parse(const char* base, size_t len) {
+    const char* end = base + len;
+    while (true) {
+        const char* line = base + length;
+        const char* eol = base + scan;
+        if (in_headers && !colon) {
+            // one pass: the colon, if it comes before the end of the line
+            eol = find(eol, end, ':', '\r', '\n');
+            if (eol != end && *eol == ':') {
+                colon = eol - base;
+                eol = find(eol + 1, end, '\r', '\n', '\n');
+            }
+        } else {
+            eol = find(eol, end, '\r', '\n', '\n');
+        }
+        if (eol == end) {
+            scan = len;
+            return PARSE_INCOMPLETE;
+        }
+        if (*eol != '\r')
+            return PARSE_BAD;
+        if (eol + 1 == end) {
+            scan = eol - base;                  // find it again with its '\n'
+            return PARSE_INCOMPLETE;
+        }
+        if (eol[1] != '\n')
+            return PARSE_BAD;
+
+        if (!in_headers) {
+            if (!request_line(base, line, eol))
+                return PARSE_BAD;
+            in_headers = true;
+        } else if (eol == line) {
+            length = eol + 2 - base;
+            return PARSE_OK;
+        } else if (colon) {
+            const char* name_end = base + colon;
+            if (name_end == line || header_count == MAX_HEADERS)
+                return PARSE_BAD;
+            const char* value = name_end + 1;
+            const char* value_end = eol;
+            while (value < value_end && is_space(*value))
+                ++value;
+            while (value_end > value && is_space(value_end[-1]))
+                --value_end;
+            http_header& header = headers[header_count++];
+            header.name = slice(base, line, name_end);
+            header.value = slice(base, value, value_end);
+            HEADER h = lookup(line, name_end - line);
+            if (h != HEADER_OTHER && !known[h])
+                known[h] = static_cast<uint8_t>(header_count);
+        }
+        length = scan = eol + 2 - base;
+        colon = 0;
+    }
+}
+
+/**
+ * @brief method, url and version, separated by spaces or tabs
+ */
+bool http_parser::request_line(const char* base, const char* line, const char* eol) {
+    const char* method_end = find(line, eol, ' ', '\t', '\t');
+    if (method_end == line || method_end == eol)
+        return false;
+    const char* target = method_end;
+    while (target < eol && is_space(*target))
+        ++target;
+    const char* target_end = find(target, eol, ' ', '\t', '\t');
+    if (target_end == target || target_end == eol)
+        return false;
+    const char* ver = target_end;
+    while (ver < eol && is_space(*ver))
+        ++ver;
+    if (ver == eol)
+        return false;
+    method = slice(base, line, method_end);
+    url = slice(base, target, target_end);
+    version = slice(base, ver, eol);
+    return true;
+}
@@ -1,7 +1,12 @@
 // C system headers
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 // C++ system headers
@@ -10,17 +15,24 @@
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 // .h files in this project
+#include "buffer.h"
+#include "config.h"
+#include "file_cache.h"
 #include "http_conn.h"
+#include "reactor.h"
 #include "threadpool.h"
+#include "uring_loop.h"
 
-const int MAX_FD = 65536;
-const int MAX_EVENT_NUMBER = 10000;
-const int TIMESLOT = 1;
-
-static time_wheel timer_wheel;
-static int pipefd[2];
+static int pipefd[2] = {-1, -1};
 
+extern const char* doc_root;
 extern int addfd (int epollfd, int sockfd, bool one_shot);
 extern int removefd (int epollfd, int sockfd);
 extern int setnonblock (int sockfd);
@@ -48,25 +60,393 @@ void show_error(int connfd, const char* info) {
     send(connfd, info, strlen(info), 0);
     close(connfd);
 }
-void timer_handler() {
-    timer_wheel.tick();
-    alarm(5 * TIMESLOT);
+void timer_handler(reactor* loop) {
+    loop->tick();
+    alarm(TIMESLOT);
+}
+/**
+ * @brief SIGHUP: drop the cached files and responses, they are reloaded on demand
+ */
+void reload() {
+    printf("reloading\n");
+    if (config.file_cache_size > 0)
+        file_cache::Getinstance()->clear();
+}
+// closes fd with the frame of a coroutine, which may be destroyed at any co_await
+struct fd_guard{
+    int fd;
+    ~fd_guard() {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+/**
+ * @brief the whole file, read 16 KB at a time without blocking the loop
+ */
+task<std::string> read_all(request& req, int fd) {
+    std::string body;
+    char buf[16 << 10];
+    ssize_t n;
+    while ((n = co_await req.read(fd, buf, sizeof(buf), static_cast<off_t>(body.size()))) > 0)
+        body.append(buf, n);
+    if (n < 0)
+        throw std::runtime_error(strerror(static_cast<int>(-n)));
+    co_return body;
+}
+/**
+ * @brief endpoints answered by a body_stream, one of each kind, and by
+ * coroutines (-e)
+ *
+ * /stream/count/:n    the numbers from 1 to n, a line each, from a generator
+ * /stream/ls          ls -l of doc_root, from the pipe of a child process
+ * /stream/follow/<path>  the file <path> of doc_root while it grows
+ * /stream/echo        POST or PUT: the body sent back, from memory or from its spool file
+ * /stream/size        POST or PUT: the size of the body and where it was kept
+ * /coro/sleep/:ms     answered after ms, from a timer
+ * /coro/cat/<path>    the file <path> of doc_root, from reads of the loop
+ * /coro/date          the output of date, once its pipe is readable
+ */
+void add_examples() {
+    http_conn::add_stream("/stream/count/:n", [](const http_conn& conn, const char*) -> std::unique_ptr<body_stream> {
+        long n = atol(std::string(conn.get_param("n")).c_str());
+        if (n <= 0)
+            return nullptr;
+        return std::make_unique<generator_stream>([n, i = 1L](char* out, size_t len) mutable {
+            size_t used = 0;
+            for (; i <= n && len - used > 20; ++i) {
+                used += header_writer::format_number(out + used, i);
+                out[used++] = '\n';
+            }
+            return used;
+        }, "text/plain");
+    });
+    http_conn::add_stream("/stream/ls", [](const http_conn&, const char*) -> std::unique_ptr<body_stream> {
+        const char* argv[] = {"ls", "-l", doc_root, nullptr};
+        return pipe_stream::spawn(argv, "text/plain");
+    });
+    http_conn::add_stream("/stream/follow/*", [](const http_conn&, const char* rest) -> std::unique_ptr<body_stream> {
+        if (rest[0] == '\0' || strstr(rest, ".."))
+            return nullptr;
+        std::string path = std::string(doc_root) + "/" + rest;
+        return file_stream::follow(path.c_str(), "text/plain");
+    });
+    http_conn::add_upload("/stream/echo", [](const http_conn&, const char*) -> std::unique_ptr<body_sink> {
+        return std::make_unique<spool_sink>([](spool_sink& body) -> std::unique_ptr<body_stream> {
+            std::shared_ptr<int> file(new int(body.release_file()), [](int* fd) {
+                if (*fd != -1)
+                    close(*fd);
+                delete fd;
+            });
+            auto memory = std::make_shared<std::string>(body.memory());
+            return std::make_unique<generator_stream>([file, memory, offset = size_t(0)](char* out, size_t len) mutable {
+                ssize_t n;
+                if (*file != -1) {
+                    n = pread(*file, out, len, static_cast<off_t>(offset));
+                } else {
+                    n = static_cast<ssize_t>(std::min(len, memory->size() - offset));
+                    memcpy(out, memory->data() + offset, n);
+                }
+                if (n <= 0)
+                    return size_t(0);
+                offset += n;
+                return static_cast<size_t>(n);
+            }, "application/octet-stream");
+        });
+    });
+    http_conn::add_upload("/stream/size", [](const http_conn& conn, const char*) -> std::unique_ptr<body_sink> {
+        // 201 for a PUT, as if something had been stored
+        int status = conn.get_method() == http_conn::PUT ? 201 : 200;
+        return std::make_unique<spool_sink>([status](spool_sink& body) -> std::unique_ptr<body_stream> {
+            auto text = std::make_shared<std::string>(std::to_string(body.size()) +
+                                                      (body.in_memory() ? " memory\n" : " file\n"));
+            return std::make_unique<generator_stream>([text](char* out, size_t len) {
+                size_t n = std::min(len, text->size());
+                memcpy(out, text->data(), n);
+                text->erase(0, n);
+                return n;
+            }, "text/plain", status);
+        });
+    });
+    http_conn::add_handler("/coro/sleep/:ms", [](request& req) -> task<response> {
+        int ms = atoi(std::string(req.param("ms")).c_str());
+        uint64_t start = time_wheel::clock();
+        co_await req.sleep(ms);
+        response res;
+        res.body = "slept " + std::to_string(time_wheel::clock() - start) + " ms\n";
+        co_return res;
+    });
+    http_conn::add_handler("/coro/cat/*", [](request& req) -> task<response> {
+        response res;
+        std::string_view rest = req.rest();
+        std::string path = std::string(doc_root) + "/" + std::string(rest);
+        fd_guard file{rest.empty() || rest.find("..") != std::string_view::npos ?
+                      -1 : open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+        if (file.fd < 0) {
+            res.status = 404;
+            res.body = "no such file\n";
+            co_return res;
+        }
+        res.content_type = "application/octet-stream";
+        res.body = co_await read_all(req, file.fd);
+        co_return res;
+    });
+    http_conn::add_handler("/coro/date", [](request& req) -> task<response> {
+        const char* argv[] = {"date", nullptr};
+        response res;
+        auto out = pipe_stream::spawn(argv, "text/plain");
+        if (!out) {
+            res.status = 500;
+            co_return res;
+        }
+        char buf[256];
+        ssize_t n;
+        while ((n = out->read(buf, sizeof(buf))) != 0) {
+            if (n > 0) {
+                res.body.append(buf, n);
+            } else if (errno != EAGAIN || co_await req.readable(out->wait_fd()) < 0) {
+                res.status = 500;
+                break;
+            }
+        }
+        co_return res;
+    });
 }
-void cb_func(http_conn* user_data) {
-    // Close the client
-    printf("Close fd %d\n", user_data->sockfd);
-    user_data->close_conn();
+/**
+ * @brief choose the sub-reactor which will own the new connection
+ */
+reactor* select_reactor(std::vector<std::unique_ptr<reactor>>& loops) {
+    static size_t next = 0;
+    if (config.dispatch == DISPATCH_LEAST_LOAD) {
+        reactor* least = loops[0].get();
+        for (auto& loop : loops)
+            if (loop->load() < least->load())
+                least = loop.get();
+        return least;
+    }
+    next = (next + 1) % loops.size();
+    return loops[next].get();
+}
+/**
+ * @brief create the listening socket, bound to ip:port
+ */
+int open_listenfd(const char* ip, int port, bool reuseport) {
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    assert(listenfd >= 0);
+    struct linger tmp = {1, 0};
+    setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+    if (reuseport) {
+        int on = 1;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+
+    int ret = 0;
+    struct sockaddr_in address{};
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &address.sin_addr);
+    address.sin_port = htons(port);
+
+    ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+    assert(ret >= 0);
+
+    ret = listen(listenfd, config.backlog);
+    assert(ret >= 0);
+    return listenfd;
+}
+/**
+ * @brief the cpus the process may run on (taskset, cpusets), in increasing order
+ */
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; ++c) {
+            if (CPU_ISSET(c, &cpuset))
+                cpus.push_back(c);
+        }
+    }
+    if (cpus.empty()) {
+        for (int c = 0; c < static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u)); ++c)
+            cpus.push_back(c);
+    }
+    return cpus;
+}
+/**
+ * @brief steer every connection to the socket whose index is that of the cpu
+ * handling it in cpus
+ *
+ * The sockets of a reuseport group are indexed in bind order, and the i-th
+ * sub-reactor is pinned to cpus[i], so a flow stays on the cpu of its IRQ:
+ * there have to be as many sockets as cpus. An IRQ on a cpu we may not run
+ * on is hashed by its number.
+ */
+bool attach_cpu_steering(int listenfd, const std::vector<int>& cpus) {
+    std::vector<sock_filter> code;
+    code.push_back({BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<__u32>(SKF_AD_OFF + SKF_AD_CPU)}); // A = cpu
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        code.push_back({BPF_JMP | BPF_JEQ | BPF_K, 0, 1, static_cast<__u32>(cpus[i])});           // A == cpus[i]
+        code.push_back({BPF_RET | BPF_K, 0, 0, static_cast<__u32>(i)});                          // return i
+    }
+    code.push_back({BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<__u32>(cpus.size())});          // A %= size
+    code.push_back({BPF_RET | BPF_A, 0, 0, 0});                                                 // return A
+    if (code.size() > BPF_MAXINSNS)
+        return false;
+    struct sock_fprog prog = {static_cast<unsigned short>(code.size()), code.data()};
+    return setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+void usage(const char* prog) {
+    printf("Usage: %s ip_address port_number [-r reactors] [-d rr|least] "
+           "[-b backlog] [-p] [-c] [-i epoll|uring] [-s mmap|sendfile] "
+           "[-f file_cache_MB] [-S small_file_KB] [-M response_cache_MB] [-z encoded_cache_MB] [-H max_header_KB] "
+           "[-q steal|lockfree|mutex] [-t alarm|timerfd] [-e] [-B max_body_MB] [-m body_memory_KB] "
+           "[-T spool_dir] [-A prefix=dir]...\n", prog);
+}
+bool parse_options(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:b:pci:s:f:S:M:z:H:q:t:eB:m:T:A:")) != -1) {
+        switch (opt) {
+            case 'r':
+                config.reactors = atoi(optarg);
+                if (config.reactors < 0)
+                    return false;
+                break;
+            case 'd':
+                if (strcmp(optarg, "rr") == 0)
+                    config.dispatch = DISPATCH_ROUND_ROBIN;
+                else if (strcmp(optarg, "least") == 0)
+                    config.dispatch = DISPATCH_LEAST_LOAD;
+                else
+                    return false;
+                break;
+            case 'b':
+                config.backlog = atoi(optarg);
+                if (config.backlog <= 0)
+                    return false;
+                break;
+            case 'p':
+                config.reuseport = true;
+                break;
+            case 'c':
+                config.cpu_steering = true;
+                break;
+            case 'i':
+                if (strcmp(optarg, "epoll") == 0)
+                    config.backend = IO_EPOLL;
+                else if (strcmp(optarg, "uring") == 0)
+                    config.backend = IO_URING;
+                else
+                    return false;
+                break;
+            case 's':
+                if (strcmp(optarg, "mmap") == 0)
+                    config.send_mode = SEND_MMAP;
+                else if (strcmp(optarg, "sendfile") == 0)
+                    config.send_mode = SEND_SENDFILE;
+                else
+                    return false;
+                break;
+            case 'f':
+                if (atoi(optarg) < 0)
+                    return false;
+                config.file_cache_size = static_cast<size_t>(atoi(optarg)) << 20;
+                break;
+            case 'S':
+                if (atoi(optarg) < 0)
+                    return false;
+                config.small_file_size = static_cast<size_t>(atoi(optarg)) << 10;
+                break;
+            case 'M':
+                if (atoi(optarg) < 0)
+                    return false;
+                config.response_cache_size = static_cast<size_t>(atoi(optarg)) << 20;
+                break;
+            case 'z':
+                if (atoi(optarg) < 0)
+                    return false;
+                config.encoded_cache_size = static_cast<size_t>(atoi(optarg)) << 20;
+                break;
+            case 'H':
+                // a request line has to fit, and buffers stop at buffer::MAX_CHUNK
+                if (atoi(optarg) < 1 || static_cast<size_t>(atoi(optarg)) << 10 > buffer::MAX_CHUNK)
+                    return false;
+                config.max_header_size = static_cast<size_t>(atoi(optarg)) << 10;
+                break;
+            case 'q':
+                if (strcmp(optarg, "steal") == 0)
+                    config.queue = QUEUE_STEALING;
+                else if (strcmp(optarg, "lockfree") == 0)
+                    config.queue = QUEUE_LOCKFREE;
+                else if (strcmp(optarg, "mutex") == 0)
+                    config.queue = QUEUE_MUTEX;
+                else
+                    return false;
+                break;
+            case 't':
+                if (strcmp(optarg, "alarm") == 0)
+                    config.timer = TIMER_ALARM;
+                else if (strcmp(optarg, "timerfd") == 0)
+                    config.timer = TIMER_FD;
+                else
+                    return false;
+                break;
+            case 'e':
+                config.examples = true;
+                break;
+            case 'B':
+                if (atoi(optarg) < 0)
+                    return false;
+                config.max_body_size = static_cast<size_t>(atoi(optarg)) << 20;
+                break;
+            case 'm':
+                if (atoi(optarg) < 0)
+                    return false;
+                config.body_memory_size = static_cast<size_t>(atoi(optarg)) << 10;
+                break;
+            case 'T':
+                config.spool_dir = optarg;
+                break;
+            case 'A': {
+                // the files of dir answer the urls under prefix, instead of doc_root
+                std::string alias = optarg;
+                size_t eq = alias.find('=');
+                if (alias[0] != '/' || eq == std::string::npos || eq + 1 == alias.size())
+                    return false;
+                http_conn::add_static(alias.substr(0, eq).c_str(), alias.c_str() + eq + 1);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    // every reuseport listener is owned by a sub-reactor
+    if (config.reuseport && config.reactors == 0)
+        config.reactors = static_cast<int>(allowed_cpus().size());
+    if (config.cpu_steering && !config.reuseport)
+        return false;
+    // the rings send whole responses with writev
+    if (config.backend == IO_URING)
+        config.send_mode = SEND_MMAP;
+    return argc - optind == 2;
 }
 
 int main (int argc, char* argv[]) {
-    if (argc <= 2) {
-        printf("Usage: %s ip_address port_number\n", basename(argv[0]));
+    if (!parse_options(argc, argv)) {
+        usage(basename(argv[0]));
         return 1;
     }
-    const char* ip = argv[1];
-    int port = atoi(argv[2]);
+    const char* ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
 
     addsig(SIGPIPE, SIG_IGN);           //ignore the SIGPIPE
+    // with timerfd, signals are only read from a signalfd: block them before any
+    // thread starts, so that every thread inherits the mask and none is interrupted
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    if (config.timer == TIMER_FD)
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
 
     threadpool<http_conn> *pool = nullptr;
     try {
@@ -76,71 +456,124 @@ int main (int argc, char* argv[]) {
         return 1;
     }
 
-    auto users = new http_conn[MAX_FD];
-    assert(users);
     http_conn::user_count = 0;
+    if (config.examples)
+        add_examples();
 
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(listenfd >= 0);
-    struct linger tmp = {1, 0};
-    setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
-
-    int ret = 0;
-    struct sockaddr_in address{};
-    bzero(&address, sizeof(address));
-    address.sin_family = AF_INET;
-    inet_pton(AF_INET, ip, &address.sin_addr);
-    address.sin_port = htons(port);
+    if (config.backend == IO_URING && !uring_loop().init(-1)) {
+        printf("io_uring is not available, fall back to epoll\n");
+        config.backend = IO_EPOLL;
+    }
 
-    ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
-    assert(ret >= 0);
+    int listenfd = -1;
+    if (!config.reuseport)
+        listenfd = open_listenfd(ip, port, false);
 
-    ret = listen(listenfd, 5);
-    assert(ret >= 0);
+    // main_loop owns the connections unless sub-reactors or io_uring are
+    // requested, in which case the main thread only accepts and handles signals
+    reactor main_loop(pool);
+    std::vector<std::unique_ptr<reactor>> sub_loops;
+    std::vector<std::unique_ptr<uring_loop>> rings;
+    std::vector<int> shard_fds;                         // SO_REUSEPORT listeners
+    std::vector<int> cpu_ids = allowed_cpus();
+    int cpus = static_cast<int>(cpu_ids.size());
+    int loops = config.backend == IO_URING ? std::max(config.reactors, 1) : config.reactors;
+    for (int i = 0; i < loops; ++i) {
+        int fd = listenfd;
+        if (config.reuseport) {
+            fd = open_listenfd(ip, port, true);
+            shard_fds.push_back(fd);
+        }
+        if (config.backend == IO_URING) {
+            rings.emplace_back(new uring_loop);
+            rings.back()->init(fd);
+        } else {
+            sub_loops.emplace_back(new reactor(pool));
+            if (config.reuseport)
+                sub_loops.back()->listen_on(fd);
+        }
+    }
+    // cpu c goes to the shard pinned to c only with a shard per cpu: with more,
+    // some would get nothing, with fewer, cpu c would land on the cpu c % loops
+    bool steering = config.cpu_steering;
+    if (steering && loops != cpus) {
+        printf("-c needs a loop per cpu (%d), not %d: connections are hashed\n", cpus, loops);
+        steering = false;
+    }
+    if (steering && !attach_cpu_steering(shard_fds[0], cpu_ids))
+        printf("attach reuseport cbpf fails: %s\n", strerror(errno));
+    if (steering)
+        pool->pin(cpu_ids);                         // before the loops hand it requests
+    for (int i = 0; i < loops; ++i) {
+        int cpu = steering ? cpu_ids[i] : -1;
+        if (config.backend == IO_URING)
+            rings[i]->start(cpu);
+        else
+            sub_loops[i]->start(cpu);
+    }
 
     epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
-    assert(epollfd != -1);
-    addfd(epollfd, listenfd, false);
-    http_conn::epollfd = epollfd;
-
-    socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
-    setnonblock(pipefd[1]);
-    addfd(epollfd, pipefd[0], false);           //monitor by main thread
-    addsig(SIGALRM, sig_handler);
-    addsig(SIGTERM ,sig_handler);
-    alarm(TIMESLOT);
+    int epollfd = main_loop.get_epollfd();
+    if (listenfd != -1 && config.backend == IO_EPOLL)
+        addfd(epollfd, listenfd, false);
+
+    int sigfd = -1;
+    if (config.timer == TIMER_FD) {
+        sigfd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        assert(sigfd != -1);
+        addfd(epollfd, sigfd, false);
+    } else {
+        socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
+        setnonblock(pipefd[1]);
+        addfd(epollfd, pipefd[0], false);           //monitor by main thread
+    }
+    int notifyfd = -1;
+    if (config.file_cache_size > 0) {
+        notifyfd = file_cache::Getinstance()->get_notifyfd();
+        if (notifyfd != -1)
+            addfd(epollfd, notifyfd, false);
+    }
+    if (config.timer == TIMER_ALARM) {
+        addsig(SIGALRM, sig_handler);
+        addsig(SIGTERM ,sig_handler);
+        addsig(SIGHUP, sig_handler);
+        alarm(TIMESLOT);
+    }
     bool stop_server = false;
     bool timeout = false;
     while (!stop_server)
     {
+        main_loop.arm_timer();                  // nothing to do with alarm
         int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
         if ((number < 0) && (errno != EINTR)) {
             printf( "epoll failure\n" );
             break;
         }
+        main_loop.tick();                       // keeps the wheel clock fresh for the stamps of reads
 
         for ( int i = 0; i < number; i++ ) {
             int sockfd = events[i].data.fd;
             if (sockfd == listenfd) {
-                struct sockaddr_in client_address{};
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr *) &client_address, &client_addrlength);
-                if (connfd < 0) {
-                    printf("errno is: %d\n", errno);
-                    continue;
-                }
-                if (http_conn::user_count >= MAX_FD) {
-                    show_error(connfd, "Internal server busy");
-                    continue;
+                // edge triggered: accept until EAGAIN, or the backlog waits for the next client
+                while (true) {
+                    struct sockaddr_in client_address{};
+                    socklen_t client_addrlength = sizeof(client_address);
+                    int connfd = accept(listenfd, (struct sockaddr *) &client_address, &client_addrlength);
+                    if (connfd < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                            printf("errno is: %d\n", errno);
+                        break;
+                    }
+                    if (connfd >= MAX_FD || http_conn::user_count >= MAX_FD) {
+                        show_error(connfd, "Internal server busy");
+                        continue;
+                    }
+                    printf("connecting...\n");
+                    if (sub_loops.empty())
+                        main_loop.add_conn(connfd, client_address);
+                    else
+                        select_reactor(sub_loops)->dispatch(connfd, client_address);
                 }
-                printf("connecting...\n");
-                printf("User: %d connected\n", connfd);
-                tw_timer* timer = timer_wheel.add_timer(8*TIMESLOT);
-                users[connfd].init(connfd, client_address, timer);
-
-                timer->user_data = &users[connfd];
-                timer->cb_func = cb_func;
             } else if ((sockfd == pipefd[0]) && (events[i].events & EPOLLIN)) {
                 char msg[1024];
                 int ret = recv(sockfd, &msg, sizeof(msg), 0);
@@ -155,60 +588,52 @@ int main (int argc, char* argv[]) {
                             case SIGTERM:
                                 stop_server = true;
                                 break;
+                            case SIGHUP:
+                                reload();
+                                break;
                         }
                     }
                 }
-            }
-            // EPOLLRDHUP: client closes the connection
-            else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                printf("Close %d cause some reasons\n", sockfd);
-                tw_timer* timer = users[sockfd].timer;
-                cb_func(&users[sockfd]);
-                    if(timer) {
-                        timer_wheel.del_timer(timer);
-                    }
-            } else if (events[i].events & EPOLLIN) {
-                printf("User: %d reading...\n", sockfd);
-                tw_timer* timer = users[sockfd].timer;
-                if (users[sockfd].read()) {
-                    if (timer) {
-                        timer_wheel.del_timer(timer);
-                        tw_timer *pTimer = timer_wheel.add_timer(30 * TIMESLOT);
-                        pTimer->user_data = &users[sockfd];
-                        pTimer->cb_func = cb_func;
-                        users[sockfd].timer = pTimer;
-                    }
-                    pool->append(users + sockfd);
-                }
-                else {
-                    cb_func(&users[sockfd]);
-                    if (timer)
-                        timer_wheel.del_timer(timer);
-                }
-
-            } else if (events[i].events & EPOLLOUT) {
-                printf("User: %d writing...\n", sockfd);
-                tw_timer* timer = users[sockfd].timer;
-                if (!users[sockfd].write()) {
-                    cb_func(&users[sockfd]);
-                    if (timer) {
-                        timer_wheel.del_timer(timer);
-                    }
+            } else if (sockfd == sigfd) {
+                // edge triggered, read every pending signal
+                signalfd_siginfo info{};
+                while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                    if (info.ssi_signo == SIGTERM)
+                        stop_server = true;
+                    else if (info.ssi_signo == SIGHUP)
+                        reload();
                 }
+            } else if (sockfd == main_loop.get_timerfd()) {
+                main_loop.handle_timer();
+            }
+            else if (sockfd == notifyfd) {
+                file_cache::Getinstance()->handle_events();
+            }
+            else {
+                main_loop.handle_event(events[i]);
             }
-            else
-            {}
         }
         if(timeout) {
             timeout = false;
-            timer_handler();
+            timer_handler(&main_loop);
         }
     }
-    close(pipefd[0]);
-    close(pipefd[1]);
-    close(epollfd);
-    close(listenfd);
-    delete [] users;
+    for (auto& loop : sub_loops)
+        loop->stop();
+    for (auto& ring : rings)
+        ring->stop();
+    if (config.backend == IO_URING) {
+        for (int fd : shard_fds)
+            close(fd);
+    }
+    if (sigfd != -1)
+        close(sigfd);
+    if (pipefd[0] != -1) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    if (listenfd != -1)
+        close(listenfd);
     delete pool;
     return 0;
 }
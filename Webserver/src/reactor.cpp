@@ -0,0 +1,319 @@
+//
+// Created by tyz on 23-5-20.
+//
+
+// C system headers
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+// C++ system headers
+#include <cassert>
+#include <cstdio>
+// .h files in this project
+#include "http_date.h"
+#include "reactor.h"
+
+extern void addfd(int epollfd, int sockfd, bool oneshot);
+extern void modfd(int epollfd, int sockfd, int ev);
+
+static int cb_func(http_conn* user_data) {
+    // a worker still has it, closing now would pull the object from under it
+    if (user_data->tasks.load(std::memory_order_acquire) > 0)
+        return 1000;
+    // read since the timer was armed, sleep again for what is left
+    if (int left = user_data->remaining(time_wheel::clock()))
+        return left;
+    // Close the client
+    printf("Close fd %d\n", user_data->sockfd);
+    user_data->close_conn();
+    return 0;
+}
+
+reactor::reactor(threadpool<http_conn>* pool)
+    : listenfd(-1), timerfd(-1), timer_deadline(0), cpu(-1), conns(conn_table::Getinstance()), pool(pool),
+      conn_count(0), stopped(false)
+{
+    epollfd = epoll_create(5);
+    assert(epollfd != -1);
+    wakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(wakeupfd != -1);
+    epoll_event event{};
+    event.data.fd = wakeupfd;
+    event.events = EPOLLIN;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, wakeupfd, &event);
+    if (config.timer == TIMER_FD) {
+        // the clock of time_wheel is CLOCK_MONOTONIC, deadlines are set as they are
+        timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        assert(timerfd != -1);
+        event.data.fd = timerfd;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, timerfd, &event);
+    }
+}
+
+reactor::~reactor() {
+    stop();
+    if (listenfd != -1)
+        close(listenfd);
+    if (timerfd != -1)
+        close(timerfd);
+    close(wakeupfd);
+    close(epollfd);
+}
+
+void reactor::start(int cpu) {
+    this->cpu = cpu;
+    thread = std::thread(&reactor::loop, this);
+    if (cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset);
+    }
+}
+
+void reactor::listen_on(int fd) {
+    listenfd = fd;
+    addfd(epollfd, listenfd, false);
+}
+
+/**
+ * @brief accept until EAGAIN, the listenfd is edge triggered
+ */
+void reactor::accept_conns() {
+    while (true) {
+        struct sockaddr_in client_address{};
+        socklen_t client_addrlength = sizeof(client_address);
+        int connfd = accept(listenfd, (struct sockaddr *) &client_address, &client_addrlength);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                printf("errno is: %d\n", errno);
+            return;
+        }
+        if (connfd >= MAX_FD || http_conn::user_count >= MAX_FD) {
+            close(connfd);
+            continue;
+        }
+        add_conn(connfd, client_address);
+    }
+}
+
+void reactor::stop() {
+    stopped = true;
+    uint64_t one = 1;
+    ::write(wakeupfd, &one, sizeof(one));
+    if (thread.joinable())
+        thread.join();
+}
+
+void reactor::dispatch(int connfd, const sockaddr_in& addr) {
+    {
+        std::lock_guard<std::mutex> guard1(pending_locker);
+        pending.emplace_back(connfd, addr);
+    }
+    // count it now, so that the least-load policy sees it before loop() does
+    conn_count.fetch_add(1, std::memory_order_relaxed);
+    uint64_t one = 1;
+    ::write(wakeupfd, &one, sizeof(one));
+}
+
+void reactor::drain_pending() {
+    uint64_t cnt;
+    ::read(wakeupfd, &cnt, sizeof(cnt));
+    std::vector<std::pair<int, sockaddr_in>> conns;
+    {
+        std::lock_guard<std::mutex> guard1(pending_locker);
+        conns.swap(pending);
+    }
+    for (auto& conn : conns) {
+        conn_count.fetch_sub(1, std::memory_order_relaxed);
+        add_conn(conn.first, conn.second);
+    }
+}
+
+void reactor::add_conn(int connfd, const sockaddr_in& addr) {
+    printf("User: %d connected\n", connfd);
+    conn_count.fetch_add(1, std::memory_order_relaxed);
+    http_conn* conn = conns->acquire(connfd);
+    conn->init(connfd, addr, this);
+    conn->timer.cb_func = cb_func;
+    conn->touch(timer_wheel.current(), HEADER_TIMEOUT);
+    timer_wheel.add_timer(&conn->timer, HEADER_TIMEOUT);
+}
+
+void reactor::close_conn(http_conn* conn) {
+    timer_wheel.del_timer(&conn->timer);
+    conn->close_conn();
+}
+
+void reactor::handle_event(const epoll_event& event) {
+    int sockfd = event.data.fd;
+    http_conn* conn = conns->get(sockfd);
+    if (!conn)
+        return;                                     // closed by an earlier event of this round
+    if (event.data.u64 & http_conn::STREAM_EVENT) {
+        if (conn->wait.fd != -1) {
+            // watched by the handler, which may close it once resumed
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->wait.fd, nullptr);
+            conn->wait.fd = -1;
+            conn->wait.result = event.events;
+            resume_write(conn);
+        } else if (conn->streaming()) {
+            // the body_stream has more, or has ended: a hang up there isn't the client's
+            resume_write(conn);
+        }
+        return;
+    }
+    // EPOLLRDHUP: client closes the connection
+    if (event.events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        printf("Close %d cause some reasons\n", sockfd);
+        close_conn(conn);
+    } else if (event.events & EPOLLIN) {
+        printf("User: %d reading...\n", sockfd);
+        if (conn->read()) {
+            conn->touch(timer_wheel.current(), KEEPALIVE_TIMEOUT);
+            submit(conn);
+        } else {
+            close_conn(conn);
+        }
+    } else if (event.events & EPOLLOUT) {
+        printf("User: %d writing...\n", sockfd);
+        resume_write(conn);
+    }
+}
+
+void reactor::resume_write(http_conn* conn) {
+    // the client takes what is sent, a long response isn't idle
+    conn->touch(timer_wheel.current(), KEEPALIVE_TIMEOUT);
+    if (!conn->write())
+        close_conn(conn);
+    else if (conn->has_more())
+        submit(conn);                               // pipelined requests the batch left
+}
+
+/**
+ * @brief resume the handler of conn once fd has events, the socket only
+ * reports a hang up meanwhile
+ */
+bool reactor::watch(http_conn* conn, int fd, uint32_t events) {
+    epoll_event event{};
+    event.data.u64 = http_conn::STREAM_EVENT | static_cast<uint32_t>(conn->sockfd);
+    event.events = events | EPOLLONESHOT;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        conn->wait.result = -errno;                 // not pollable, or in epollfd already
+        return false;
+    }
+    conn->wait.fd = fd;
+    modfd(epollfd, conn->sockfd, 0);
+    return true;
+}
+
+bool reactor::sleep(http_conn* conn, int ms) {
+    conn->wait.timer.cb_func = [](http_conn* user_data) {
+        user_data->wait.result = 0;
+        user_data->get_loop()->wake(user_data);
+        return 0;
+    };
+    timer_wheel.add_timer(&conn->wait.timer, ms > 0 ? ms : 0);
+    modfd(epollfd, conn->sockfd, 0);
+    return true;
+}
+
+/**
+ * @brief a read from the page cache is done at once; one which would wait
+ * for the disk goes to the threadpool, there is no asynchronous read of a
+ * file with epoll. process() does it, then arms EPOLLOUT of the socket,
+ * which is writable, to resume the handler here.
+ */
+bool reactor::read_file(http_conn* conn) {
+    http_conn::suspension& wait = conn->wait;
+    iovec iov{wait.buf, wait.len};
+    ssize_t n = preadv2(wait.read_fd, &iov, 1, wait.offset, RWF_NOWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EOPNOTSUPP)) {
+        conn->tasks.fetch_add(1, std::memory_order_relaxed);
+        if (pool->append(conn, cpu))
+            return true;
+        // the queue is full, block this loop rather than fail the read
+        conn->tasks.fetch_sub(1, std::memory_order_relaxed);
+        n = pread(wait.read_fd, wait.buf, wait.len, wait.offset);
+    }
+    wait.result = n < 0 ? -errno : n;
+    wait.read_fd = -1;
+    return false;
+}
+
+void reactor::forget(http_conn* conn) {
+    timer_wheel.del_timer(&conn->wait.timer);
+    if (conn->wait.fd != -1) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->wait.fd, nullptr);
+        conn->wait.fd = -1;
+    }
+}
+
+void reactor::submit(http_conn* conn) {
+    conn->tasks.fetch_add(1, std::memory_order_relaxed);
+    if (!pool->append(conn, cpu)) {                 // the worker on our cpu, if pinned
+        conn->tasks.fetch_sub(1, std::memory_order_relaxed);
+        close_conn(conn);
+    }
+}
+
+void reactor::tick() {
+    timer_wheel.tick();
+    http_date::refresh();
+}
+
+/**
+ * @brief set the timerfd to the next slot of the wheel, a syscall only when it moved
+ */
+void reactor::arm_timer() {
+    if (timerfd == -1)
+        return;
+    uint64_t deadline = timer_wheel.next_deadline();
+    if (deadline == timer_deadline)
+        return;
+    itimerspec spec{};                              // all zero disarms it
+    if (deadline) {
+        spec.it_value.tv_sec = static_cast<time_t>(deadline / 1000);
+        spec.it_value.tv_nsec = static_cast<long>(deadline % 1000) * 1000000;
+    }
+    timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    timer_deadline = deadline;
+}
+
+void reactor::handle_timer() {
+    uint64_t expirations;
+    while (read(timerfd, &expirations, sizeof(expirations)) > 0) {}
+    // the wheel was ticked before the events of this round, arm for what is next
+    timer_deadline = 0;
+}
+
+/**
+ * @brief loop of a sub-reactor, epoll_wait sleeps until the next timer is due,
+ * or until its timerfd expires
+ */
+void reactor::loop() {
+    std::vector<epoll_event> events(MAX_EVENT_NUMBER);
+    while (!stopped) {
+        arm_timer();
+        int number = epoll_wait(epollfd, events.data(), MAX_EVENT_NUMBER,
+                                timerfd == -1 ? timer_wheel.next_timeout() : -1);
+        if ((number < 0) && (errno != EINTR)) {
+            printf("epoll failure\n");
+            break;
+        }
+        // before the events, so that the stamps of their reads are fresh
+        tick();
+        for (int i = 0; i < number; i++) {
+            if (events[i].data.fd == wakeupfd)
+                drain_pending();
+            else if (events[i].data.fd == listenfd)
+                accept_conns();
+            else if (events[i].data.fd == timerfd)
+                handle_timer();
+            else
+                handle_event(events[i]);
+        }
+    }
+}
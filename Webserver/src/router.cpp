@@ -0,0 +1,55 @@
+//
+// Created by tyz on 23-6-1.
+//
+
+// C++ system headers
+#include <algorithm>
+// .h files in this project
+#include "router.h"
+
+bool router::add(std::string_view pattern, int method, int target) {
+    if (method < 0 || method >= MAX_METHODS)
+        return false;
+    auto found = std::find_if(routes.begin(), routes.end(), [&](const route& r) { return r.pattern == pattern; });
+    if (found == routes.end()) {
+        if (!trie.add(pattern, static_cast<int>(routes.size())))
+            return false;
+        trie.compile();
+        route r;
+        r.pattern = std::string(pattern);
+        for (size_t i = 1; i < pattern.size(); ++i) {
+            if (pattern[i] == ':' && pattern[i - 1] == '/') {
+                size_t end = std::min(pattern.find('/', i), pattern.size());
+                r.params.emplace_back(pattern.substr(i + 1, end - i - 1));
+            }
+        }
+        std::fill(std::begin(r.targets), std::end(r.targets), -1);
+        r.methods = 0;
+        routes.push_back(std::move(r));
+        found = routes.end() - 1;
+    }
+    if (found->targets[method] != -1)
+        return false;
+    found->targets[method] = target;
+    found->methods |= 1u << method;
+    return true;
+}
+
+int router::find(int method, std::string_view path, route_trie::match& m) const {
+    if (routes.empty() || !trie.find(path, m)) {
+        m.route = -1;
+        return -1;
+    }
+    return routes[m.route].targets[method];
+}
+
+std::string_view router::param(const route_trie::match& m, std::string_view path, std::string_view name) const {
+    if (m.route == -1)
+        return std::string_view();
+    const std::vector<std::string>& names = routes[m.route].params;
+    for (int i = 0; i < m.param_count && i < static_cast<int>(names.size()); ++i) {
+        if (names[i] == name)
+            return path.substr(m.params[i].offset, m.params[i].length);
+    }
+    return std::string_view();
+}
@@ -0,0 +1,567 @@
+//
+// Created by tyz on 23-5-21.
+//
+
+// C system headers
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+// C++ system headers
+#include <cstdio>
+#include <cstring>
+// .h files in this project
+#include "http_date.h"
+#include "reactor.h"
+#include "uring_loop.h"
+
+// user_data of a SQE: the operation in the high 32 bits, the fd in the low ones
+static inline __u64 make_data(int op, int fd) {
+    return (static_cast<__u64>(op) << 32) | static_cast<__u32>(fd);
+}
+
+// the timer callbacks run inside tick(), on the thread of this loop
+static thread_local uring_loop* current_loop = nullptr;
+
+static int cb_func(http_conn* user_data) {
+    // read since the timer was armed, sleep again for what is left
+    if (int left = user_data->remaining(time_wheel::clock()))
+        return left;
+    // Close the client
+    printf("Close fd %d\n", user_data->sockfd);
+    current_loop->shut(user_data->sockfd);
+    return 0;
+}
+
+uring_loop::uring_loop()
+    : ringfd(-1), listenfd(-1), conns(conn_table::Getinstance()), states(MAX_FD / STATE_PAGE), tick_ts{},
+      sq_ptr(MAP_FAILED), sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), sqe_tail(0), sqe_submitted(0),
+      cq_ptr(MAP_FAILED), buf_ring(static_cast<io_uring_buf_ring*>(MAP_FAILED)),
+      bufs(nullptr), stopped(false)
+{
+}
+
+uring_loop::~uring_loop() {
+    stop();
+    if (buf_ring != MAP_FAILED)
+        munmap(buf_ring, BUF_COUNT * sizeof(io_uring_buf));
+    delete [] bufs;
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED)
+        munmap(sq_ptr, sq_size);
+    if (ringfd != -1)
+        close(ringfd);
+}
+
+bool uring_loop::setup_ring() {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = ENTRIES * 4;                // multishot requests post many CQEs
+    ringfd = static_cast<int>(syscall(__NR_io_uring_setup, ENTRIES, &params));
+    if (ringfd < 0)
+        return false;
+
+    // multishot recv came with kernel 6.0, together with IORING_OP_SEND_ZC
+    char probe_buf[sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)] = {};
+    auto probe = reinterpret_cast<io_uring_probe*>(probe_buf);
+    if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+        probe->last_op < IORING_OP_SEND_ZC ||
+        !(probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED))
+        return false;
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = std::max(sq_size, cq_size);
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ringfd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        return false;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else {
+        cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ringfd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            return false;
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED)
+        return false;
+
+    auto sq = static_cast<char*>(sq_ptr);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    auto cq = static_cast<char*>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    sqe_tail = sqe_submitted = *sq_tail;
+    return true;
+}
+
+bool uring_loop::setup_buffers() {
+    size_t ring_size = BUF_COUNT * sizeof(io_uring_buf);
+    buf_ring = static_cast<io_uring_buf_ring*>(mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (buf_ring == MAP_FAILED)
+        return false;
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<__u64>(buf_ring);
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+    bufs = new char[BUF_COUNT * BUF_SIZE];
+    for (unsigned i = 0; i < BUF_COUNT; ++i)
+        recycle_buffer(static_cast<unsigned short>(i));
+    return true;
+}
+
+bool uring_loop::init(int fd) {
+    listenfd = fd;
+    return setup_ring() && setup_buffers();
+}
+
+void uring_loop::start(int cpu) {
+    thread = std::thread(&uring_loop::loop, this);
+    if (cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset);
+    }
+}
+
+/**
+ * @brief the loop notices it within one TIMESLOT, when a tick completes
+ */
+void uring_loop::stop() {
+    stopped = true;
+    if (thread.joinable())
+        thread.join();
+}
+
+io_uring_sqe* uring_loop::get_sqe() {
+    if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= ENTRIES)
+        enter(0);                                   // the SQ ring is full, flush it
+    unsigned index = sqe_tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    ++sqe_tail;
+    return sqe;
+}
+
+/**
+ * @brief publish and submit the pending SQEs, wait for min_complete CQEs
+ */
+int uring_loop::enter(unsigned min_complete) {
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = sqe_tail - sqe_submitted;
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret = static_cast<int>(syscall(__NR_io_uring_enter, ringfd, to_submit,
+                                       min_complete, flags, nullptr, 0));
+    if (ret > 0)
+        sqe_submitted += ret;
+    return ret;
+}
+
+void uring_loop::arm_accept() {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = make_data(OP_ACCEPT, listenfd);
+}
+
+void uring_loop::arm_recv(int fd) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = make_data(OP_RECV, fd);
+    state_of(fd).recving = true;
+}
+
+void uring_loop::arm_writev(int fd) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    http_conn* conn = conns->get(fd);
+    sqe->addr = reinterpret_cast<__u64>(conn->get_iov());
+    sqe->len = conn->get_iov_count();
+    sqe->user_data = make_data(OP_WRITEV, fd);
+    state_of(fd).writing = true;
+}
+
+/**
+ * @brief wait for source, the wait_fd() of the body_stream answering fd or
+ * a fd its handler watches
+ */
+void uring_loop::arm_poll(int fd, int source, unsigned events) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = source;
+    sqe->poll32_events = events;
+    sqe->user_data = make_data(OP_POLL, fd);
+    arm_wait(fd, OP_POLL);
+}
+
+void uring_loop::arm_wait(int fd, OP op) {
+    state_of(fd).waiting = true;
+    state_of(fd).wait_op = op;
+}
+
+bool uring_loop::watch(http_conn* conn, int fd, uint32_t events) {
+    arm_poll(conn->sockfd, fd, events);             // EPOLLIN and EPOLLOUT are POLLIN and POLLOUT
+    return true;
+}
+
+/**
+ * @brief a timeout of the ring, which is more precise than the wheel: the
+ * tick armed may sleep for a TIMESLOT
+ */
+bool uring_loop::sleep(http_conn* conn, int ms) {
+    int fd = conn->sockfd;
+    __kernel_timespec& ts = state_of(fd).sleep_ts;
+    ms = std::max(ms, 0);
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = static_cast<long long>(ms % 1000) * 1000000;
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<__u64>(&ts);
+    sqe->len = 1;
+    sqe->user_data = make_data(OP_SLEEP, fd);
+    arm_wait(fd, OP_SLEEP);
+    return true;
+}
+
+bool uring_loop::read_file(http_conn* conn) {
+    int fd = conn->sockfd;
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = conn->wait.read_fd;
+    sqe->addr = reinterpret_cast<__u64>(conn->wait.buf);
+    sqe->len = static_cast<__u32>(std::min<size_t>(conn->wait.len, UINT32_MAX));
+    sqe->off = static_cast<__u64>(conn->wait.offset);
+    sqe->user_data = make_data(OP_READ, fd);
+    arm_wait(fd, OP_READ);
+    return true;
+}
+
+/**
+ * @brief wake up when the next timer is due, or within a TIMESLOT to notice stop()
+ */
+void uring_loop::arm_tick() {
+    int wait = timer_wheel.next_timeout();
+    if (wait < 0 || wait > TIMESLOT * 1000)
+        wait = TIMESLOT * 1000;
+    tick_ts.tv_sec = wait / 1000;
+    tick_ts.tv_nsec = static_cast<long long>(wait % 1000) * 1000000;
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<__u64>(&tick_ts);
+    sqe->len = 1;
+    sqe->user_data = make_data(OP_TICK, -1);
+}
+
+void uring_loop::recycle_buffer(unsigned short bid) {
+    // not buf_ring->bufs: its flexible array is shifted by an empty struct in C++
+    unsigned short tail = buf_ring->tail;
+    io_uring_buf* buf = reinterpret_cast<io_uring_buf*>(buf_ring) + (tail & (BUF_COUNT - 1));
+    buf->addr = reinterpret_cast<__u64>(bufs + static_cast<size_t>(bid) * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&buf_ring->tail, static_cast<unsigned short>(tail + 1), __ATOMIC_RELEASE);
+}
+
+uring_loop::conn_state& uring_loop::state_of(int fd) {
+    std::unique_ptr<conn_state[]>& page = states[fd / STATE_PAGE];
+    if (!page)
+        page.reset(new conn_state[STATE_PAGE]());
+    return page[fd % STATE_PAGE];
+}
+
+void uring_loop::on_accept(const io_uring_cqe& cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE) && !stopped)
+        arm_accept();
+    if (cqe.res < 0) {
+        printf("errno is: %d\n", -cqe.res);
+        return;
+    }
+    int connfd = cqe.res;
+    if (connfd >= MAX_FD || http_conn::user_count >= MAX_FD) {
+        close(connfd);
+        return;
+    }
+    printf("User: %d connected\n", connfd);
+    // the multishot accept shares one address between its CQEs: ask the socket
+    sockaddr_in client_address{};
+    socklen_t client_addrlength = sizeof(client_address);
+    getpeername(connfd, (struct sockaddr *) &client_address, &client_addrlength);
+    http_conn* conn = conns->acquire(connfd);
+    conn->init(connfd, client_address, this);
+    conn->timer.cb_func = cb_func;
+    conn->touch(timer_wheel.current(), HEADER_TIMEOUT);
+    timer_wheel.add_timer(&conn->timer, HEADER_TIMEOUT);
+    state_of(connfd) = conn_state{false, false, false, false, OP_POLL, {}, false, {}};
+    arm_recv(connfd);
+}
+
+void uring_loop::on_recv(int fd, const io_uring_cqe& cqe) {
+    conn_state& state = state_of(fd);
+    http_conn* conn = conns->get(fd);
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+        state.recving = false;
+    if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+        auto bid = static_cast<unsigned short>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (state.closing) {
+            recycle_buffer(bid);
+        } else if (!state.parked.empty() || conn->buffered() >= HIGH_WATER) {
+            // posted before the cancel took effect, in order after what is parked
+            state.parked.emplace_back(bid, cqe.res);
+        } else {
+            // under HIGH_WATER, a buffer always fits
+            bool filled = conn->fill(bufs + static_cast<size_t>(bid) * BUF_SIZE, cqe.res);
+            recycle_buffer(bid);
+            if (!filled) {
+                drop(fd);
+                return;
+            }
+        }
+        if (!state.closing && (!state.parked.empty() || conn->buffered() >= HIGH_WATER))
+            pause_recv(fd);
+    }
+    if (state.closing) {
+        try_close(fd);
+        return;
+    }
+    if (cqe.res <= 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+        drop(fd);                                   // peer closed or error
+        return;
+    }
+    if (!state.recving && !state.paused)
+        arm_recv(fd);                               // out of buffers, the kernel ended it, or resumed
+    if (cqe.res <= 0)
+        return;
+
+    conn->touch(timer_wheel.current(), KEEPALIVE_TIMEOUT);
+    if (state.writing || state.waiting)
+        return;                                     // answered once the batch is out
+    respond(fd, conn);
+}
+
+/**
+ * @brief stop receiving for fd until unpark() finds room in its read_buf
+ */
+void uring_loop::pause_recv(int fd) {
+    conn_state& state = state_of(fd);
+    if (state.paused)
+        return;
+    state.paused = true;
+    if (state.recving) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = make_data(OP_RECV, fd);
+        sqe->user_data = make_data(OP_CANCEL, fd);
+    }
+}
+
+/**
+ * @brief hand conn the parked buffers while its read_buf is under
+ * HIGH_WATER, receive again once they are all handed
+ * @return whether any was handed
+ */
+bool uring_loop::unpark(int fd, http_conn* conn) {
+    conn_state& state = state_of(fd);
+    size_t n = 0;
+    for (; n < state.parked.size() && conn->buffered() < HIGH_WATER; ++n) {
+        auto [bid, len] = state.parked[n];
+        conn->fill(bufs + static_cast<size_t>(bid) * BUF_SIZE, len);
+        recycle_buffer(bid);
+    }
+    state.parked.erase(state.parked.begin(), state.parked.begin() + static_cast<long>(n));
+    if (state.parked.empty() && conn->buffered() < HIGH_WATER) {
+        state.paused = false;
+        if (!state.recving)
+            arm_recv(fd);
+    }
+    return n > 0;
+}
+
+/**
+ * @brief send a batch for the complete requests of conn, if there are any
+ */
+void uring_loop::respond(int fd, http_conn* conn) {
+    conn_state& state = state_of(fd);
+    http_conn::HTTP_CODE ret = conn->prepare();
+    // what prepare() consumed makes room for what was received past HIGH_WATER
+    while (ret == http_conn::NO_REQUEST && state.paused && unpark(fd, conn))
+        ret = conn->prepare();
+    if (ret == http_conn::CLOSED_CONNECTION)
+        drop(fd);
+    else if (conn->get_iov_count() == 0 && ret == http_conn::HANDLER_REQUEST)
+        pump(fd, conn);                             // the handler is all the batch
+    else if (ret != http_conn::NO_REQUEST)
+        arm_writev(fd);
+}
+
+void uring_loop::on_writev(int fd, const io_uring_cqe& cqe) {
+    conn_state& state = state_of(fd);
+    state.writing = false;
+    if (state.closing) {
+        try_close(fd);
+        return;
+    }
+    if (cqe.res < 0) {
+        drop(fd);
+        return;
+    }
+    http_conn* conn = conns->get(fd);
+    // the client takes what is sent, a long response isn't idle
+    conn->touch(timer_wheel.current(), KEEPALIVE_TIMEOUT);
+    if (!conn->advance(cqe.res))
+        arm_writev(fd);                             // short write, send the rest
+    else
+        pump(fd, conn);
+}
+
+void uring_loop::on_wait(int fd, const io_uring_cqe& cqe) {
+    conn_state& state = state_of(fd);
+    state.waiting = false;
+    if (state.closing) {
+        try_close(fd);
+        return;
+    }
+    http_conn* conn = conns->get(fd);
+    if (conn->in_handler()) {
+        // what the co_await of the handler gives, errors included
+        conn->wait.result = cqe.res == -ETIME ? 0 : cqe.res;
+        conn->wait.read_fd = -1;
+    } else if (cqe.res < 0) {
+        drop(fd);
+        return;
+    }
+    pump(fd, conn);
+}
+
+/**
+ * @brief the batch of conn is out: the response of its handler or the next
+ * chunk of its body_stream if it has one, else the next batch
+ */
+void uring_loop::pump(int fd, http_conn* conn) {
+    switch (conn->next_chunk()) {
+        case http_conn::CHUNK_READY:
+            arm_writev(fd);
+            break;
+        case http_conn::CHUNK_WAIT:
+            if (conn->streaming())
+                arm_poll(fd, conn->stream_fd());
+            break;                                  // else the handler has armed its wait
+        case http_conn::CHUNK_DONE:
+            if (!conn->finish())
+                drop(fd);
+            else
+                respond(fd, conn);                  // requests received meanwhile, or left by the batch
+            break;
+        default:
+            drop(fd);
+            break;
+    }
+}
+
+/**
+ * @brief stop the connection, the fd is closed when no SQE refers to it any more
+ *
+ * Called by the expired timer, which is out of the wheel already.
+ */
+void uring_loop::shut(int fd) {
+    conn_state& state = state_of(fd);
+    if (state.closing)
+        return;
+    state.closing = true;
+    shutdown(fd, SHUT_RDWR);                        // ends the recv and the writev
+    if (state.waiting) {
+        // the wait isn't on the socket, which can't end it
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = make_data(state.wait_op, fd);
+        sqe->user_data = make_data(OP_CANCEL, fd);
+    }
+    try_close(fd);
+}
+
+void uring_loop::drop(int fd) {
+    timer_wheel.del_timer(&conns->get(fd)->timer);
+    shut(fd);
+}
+
+void uring_loop::try_close(int fd) {
+    conn_state& state = state_of(fd);
+    if (state.recving || state.writing || state.waiting)
+        return;
+    for (auto [bid, len] : state.parked)
+        recycle_buffer(bid);
+    state.parked.clear();
+    state.paused = false;
+    conns->get(fd)->close_conn();
+}
+
+void uring_loop::loop() {
+    current_loop = this;
+    arm_accept();
+    arm_tick();
+    while (!stopped) {
+        if (enter(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            printf("io_uring_enter failure\n");
+            break;
+        }
+        // every iteration, so that the stamps of reads and the Date are fresh
+        timer_wheel.tick();
+        http_date::refresh();
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes[head & *cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+            switch (cqe.user_data >> 32) {
+                case OP_ACCEPT:
+                    on_accept(cqe);
+                    break;
+                case OP_RECV:
+                    on_recv(fd, cqe);
+                    break;
+                case OP_WRITEV:
+                    on_writev(fd, cqe);
+                    break;
+                case OP_POLL:
+                case OP_READ:
+                case OP_SLEEP:
+                    on_wait(fd, cqe);
+                    break;
+                case OP_TICK:
+                    arm_tick();
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
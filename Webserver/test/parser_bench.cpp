@@ -0,0 +1,216 @@
+//
+// Created by tyz on 23-5-26.
+//
+// Microbenchmark of the request head parser: the line by line state machine
+// http_conn used before http_parser, then http_parser with every kernel the
+// cpu has. Build it from this directory with
+//     g++ -O2 -std=c++17 -I../include parser_bench.cpp ../src/http_parser.cpp -o parser_bench
+// and run ./parser_bench [iterations].
+
+// C++ system headers
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+// .h files in this project
+#include "http_parser.h"
+
+/**
+ * @brief parse_line(), parse_request_line() and parse_headers() of http_conn
+ * as they were, without the logging
+ */
+class legacy_parser{
+public:
+    enum LINE_STATUS{LINE_OK=0, LINE_BAD, LINE_OPEN};
+    enum CHECK_STATE{CHECK_STATE_REQUESTLINE=0, CHECK_STATE_HEADER};
+
+    // 1 when the head is complete, 0 if not, -1 if bad
+    int parse(char* buf, int len) {
+        read_buf = buf;
+        read_idx = len;
+        check_idx = start_line = 0;
+        check_state = CHECK_STATE_REQUESTLINE;
+        url = version = host = nullptr;
+        linger = true;
+        content_length = 0;
+        while (parse_line() == LINE_OK) {
+            char* text = read_buf + start_line;
+            start_line = check_idx;
+            if (check_state == CHECK_STATE_REQUESTLINE) {
+                if (!parse_request_line(text))
+                    return -1;
+            } else if (parse_headers(text)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    char* url;
+    char* version;
+    char* host;
+    bool linger;
+    int content_length;
+
+private:
+    LINE_STATUS parse_line() {
+        char temp;
+        for (; check_idx < read_idx; check_idx++) {
+            temp = read_buf[check_idx];
+            if (temp == '\r') {
+                if (check_idx + 1 == read_idx)
+                    return LINE_OPEN;
+                else if (read_buf[check_idx + 1] == '\n') {
+                    read_buf[check_idx++] = '\0';
+                    read_buf[check_idx++] = '\0';
+                    return LINE_OK;
+                }
+                return LINE_BAD;
+            }
+            else if (temp == '\n') {
+                if (check_idx > 1 && read_buf[check_idx - 1] == '\r') {
+                    read_buf[check_idx - 1] = '\0';
+                    read_buf[check_idx++] = '\0';
+                    return LINE_OK;
+                }
+                return LINE_BAD;
+            }
+        }
+        return LINE_OPEN;
+    }
+    bool parse_request_line(char* text) {
+        url = strpbrk(text, " \t");
+        if (!url)
+            return false;
+        *url++ = '\0';
+        if (strcasecmp(text, "GET") != 0)
+            return false;
+        url += strspn(url, " \t");
+        version = strpbrk(url, " \t");
+        if (!version)
+            return false;
+        *version++ = '\0';
+        version += strspn(version, " \t");
+        if (strcasecmp(version, "HTTP/1.1") != 0)
+            return false;
+        check_state = CHECK_STATE_HEADER;
+        return true;
+    }
+    // true at the blank line
+    bool parse_headers(char* text) {
+        if (text[0] == '\0')
+            return true;
+        else if (strncasecmp(text, "Connection:", 11) == 0) {
+            text += 11;
+            text += strspn(text, " \t");
+            if (strcasecmp(text, "close") == 0)
+                linger = false;
+        }
+        else if (strncasecmp(text, "Content-Length:", 15) == 0) {
+            text += 15;
+            text += strspn(text, " \t");
+            content_length = atoi(text);
+        }
+        else if (strncasecmp(text, "Host:", 5) == 0) {
+            text += 5;
+            text += strspn(text, " \t");
+            host = text;
+        }
+        return false;
+    }
+
+    char* read_buf;
+    int read_idx;
+    int check_idx;
+    int start_line;
+    CHECK_STATE check_state;
+};
+
+/**
+ * @brief the Host header, as http_conn::get_header() finds it
+ */
+static std::string find_host(const char* base, const http_parser& parser) {
+    const http_header* header = parser.header(http_parser::HEADER_HOST);
+    return header ? std::string(http_parser::view(base, header->value)) : "";
+}
+
+static std::string make_request(int extra_headers, size_t cookie) {
+    std::string request = "GET /index.html?from=bench HTTP/1.1\r\n"
+                          "Host: www.example.com\r\n"
+                          "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/113.0\r\n"
+                          "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+    for (int i = 0; i < extra_headers; ++i)
+        request += "X-Header-" + std::to_string(i) + ": value-" + std::to_string(i * 7919) + "\r\n";
+    if (cookie)
+        request += "Cookie: session=" + std::string(cookie, 'c') + "\r\n";
+    request += "Connection: keep-alive\r\n\r\n";
+    return request;
+}
+
+template<typename F>
+static double ns_per_request(int iterations, F&& parse_once) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        parse_once();
+    std::chrono::duration<double, std::nano> spent = std::chrono::steady_clock::now() - start;
+    return spent.count() / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    struct { const char* name; std::string request; } cases[] = {
+        {"curl", "GET /1.txt HTTP/1.1\r\nHost: localhost\r\nUser-Agent: curl/7.81.0\r\nAccept: */*\r\n\r\n"},
+        {"browser", make_request(8, 0)},
+        {"cookie", make_request(12, 2048)},
+    };
+    const http_parser::ISA isas[] = {http_parser::ISA_SCALAR, http_parser::ISA_SSE42, http_parser::ISA_AVX2};
+
+    printf("%-8s %6s %10s", "request", "bytes", "legacy");
+    for (auto isa : isas)
+        printf(" %10s", http_parser::isa_name(isa));
+    printf("   (ns per request)\n");
+
+    std::vector<char> buf;
+    long sink = 0;
+    for (auto& c : cases) {
+        const std::string& request = c.request;
+        buf.resize(request.size() + 1);
+        // both copy the request, the legacy parser writes into it
+        legacy_parser legacy;
+        double legacy_ns = ns_per_request(iterations, [&] {
+            memcpy(buf.data(), request.data(), request.size());
+            sink += legacy.parse(buf.data(), static_cast<int>(request.size()));
+        });
+        std::string expected_host = legacy.host ? legacy.host : "";
+        printf("%-8s %6zu %10.1f", c.name, request.size(), legacy_ns);
+
+        for (auto isa : isas) {
+            if (!http_parser::use(isa)) {
+                printf(" %10s", "-");
+                continue;
+            }
+            http_parser parser;
+            double ns = ns_per_request(iterations, [&] {
+                memcpy(buf.data(), request.data(), request.size());
+                parser.reset();
+                sink += parser.parse(buf.data(), request.size());
+            });
+            // every byte at a time: the resumed parse has to agree too
+            http_parser slow;
+            http_parser::RESULT res = http_parser::PARSE_INCOMPLETE;
+            for (size_t len = 1; len <= request.size() && res == http_parser::PARSE_INCOMPLETE; ++len)
+                res = slow.parse(request.data(), len);
+            if (res != http_parser::PARSE_OK || slow.length != request.size() ||
+                find_host(request.data(), slow) != expected_host ||
+                find_host(buf.data(), parser) != expected_host) {
+                printf("\n%s disagrees with the legacy parser on %s\n", http_parser::isa_name(isa), c.name);
+                return 1;
+            }
+            printf(" %10.1f", ns);
+        }
+        printf("\n");
+    }
+    return sink == 0 ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+//
+// Created by tyz on 23-6-1.
+//
+// Microbenchmark of routing over 1000 routes: the scan of every pattern in
+// turn, as http_conn did with its prefixes, then router, which compiles the
+// patterns into a route_trie as they are added, then static_router, whose
+// trie is compiled by the compiler. Build it from this directory with
+//     g++ -O2 -std=c++20 -I../include router_bench.cpp ../src/router.cpp -o router_bench
+// and run ./router_bench [iterations].
+
+// C++ system headers
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+// .h files in this project
+#include "route_trie.h"
+#include "router.h"
+
+static const int ROUTES = 1000;
+static const size_t PATTERN_LEN = 40;
+
+/**
+ * @brief route i is one of
+ *     /api/v1/res<i>                   static
+ *     /api/v1/res<i>/:id               a parameter
+ *     /api/v1/res<i>/:id/items/:item   two
+ *     /static/d<i>/ *                  a prefix, without the space
+ * with i in 3 digits, padded with '\0' to PATTERN_LEN
+ */
+constexpr std::array<std::array<char, PATTERN_LEN>, ROUTES> make_patterns() {
+    std::array<std::array<char, PATTERN_LEN>, ROUTES> all{};
+    for (int i = 0; i < ROUTES; ++i) {
+        std::string_view head = i % 4 == 3 ? "/static/d" : "/api/v1/res";
+        std::string_view tail[] = {"", "/:id", "/:id/items/:item", "/*"};
+        size_t n = 0;
+        for (char c : head)
+            all[i][n++] = c;
+        all[i][n++] = static_cast<char>('0' + i / 100);
+        all[i][n++] = static_cast<char>('0' + i / 10 % 10);
+        all[i][n++] = static_cast<char>('0' + i % 10);
+        for (char c : tail[i % 4])
+            all[i][n++] = c;
+    }
+    return all;
+}
+constexpr auto pattern_text = make_patterns();
+constexpr std::array<std::string_view, ROUTES> patterns = [] {
+    std::array<std::string_view, ROUTES> views{};
+    for (int i = 0; i < ROUTES; ++i) {
+        size_t n = 0;
+        while (n < PATTERN_LEN && pattern_text[i][n] != '\0')
+            ++n;
+        views[i] = std::string_view(pattern_text[i].data(), n);
+    }
+    return views;
+}();
+typedef static_router<patterns> table;
+
+static_assert(table::find("/api/v1/res000") == 0);
+static_assert(table::find("/api/v1/res001/42") == 1);
+static_assert(table::find("/api/v1/res002/42/items/7") == 2);
+static_assert(table::find("/static/d003/css/site.css") == 3);
+static_assert(table::find("/api/v1/res001") == -1);
+static_assert(table::find("/index.html") == -1);
+
+/**
+ * @brief pattern against the whole of path, segment by segment
+ */
+static bool scan_match(std::string_view pattern, std::string_view path) {
+    size_t i = 0;
+    size_t j = 0;
+    while (i < pattern.size()) {
+        if (pattern[i] == '*')
+            return true;
+        if (pattern[i] == ':' && i > 0 && pattern[i - 1] == '/') {
+            size_t end = j;
+            while (end < path.size() && path[end] != '/')
+                ++end;
+            if (end == j)
+                return false;
+            while (i < pattern.size() && pattern[i] != '/')
+                ++i;
+            j = end;
+            continue;
+        }
+        if (j == path.size() || pattern[i] != path[j])
+            return false;
+        ++i;
+        ++j;
+    }
+    return j == path.size();
+}
+
+// the first route matching path, -1 if none
+static int scan(std::string_view path) {
+    for (int i = 0; i < ROUTES; ++i) {
+        if (scan_match(patterns[i], path))
+            return i;
+    }
+    return -1;
+}
+
+template<typename F>
+static double measure(const std::vector<std::string>& paths, long iterations, long& sink, F&& route) {
+    auto start = std::chrono::steady_clock::now();
+    for (long n = 0; n < iterations; ++n) {
+        for (const std::string& path : paths)
+            sink += route(path);
+    }
+    std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+    return took.count() / (static_cast<double>(iterations) * paths.size());
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000;
+    // every kind of route, spread over the table, and misses: files of doc_root
+    std::vector<std::string> paths;
+    std::vector<int> expected;
+    for (int i = 0; i < ROUTES; i += 37) {
+        char path[64];
+        switch (i % 4) {
+            case 0: snprintf(path, sizeof(path), "/api/v1/res%03d", i); break;
+            case 1: snprintf(path, sizeof(path), "/api/v1/res%03d/12345", i); break;
+            case 2: snprintf(path, sizeof(path), "/api/v1/res%03d/12345/items/678", i); break;
+            default: snprintf(path, sizeof(path), "/static/d%03d/js/app.min.js", i); break;
+        }
+        paths.emplace_back(path);
+        expected.push_back(i);
+    }
+    const char* misses[] = {"/index.html", "/api/v1/res999/1/2", "/api/v2/res001", "/static/d000/x"};
+    for (const char* miss : misses) {
+        paths.emplace_back(miss);
+        expected.push_back(-1);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    router routes;
+    for (int i = 0; i < ROUTES; ++i)
+        routes.add(patterns[i], 0, i);
+    std::chrono::duration<double, std::milli> built = std::chrono::steady_clock::now() - start;
+
+    route_trie::match m{};
+    for (size_t k = 0; k < paths.size(); ++k) {
+        int a = scan(paths[k]);
+        int b = routes.find(0, paths[k], m);
+        int c = table::find(paths[k]);
+        if (a != expected[k] || b != a || c != a) {
+            printf("%s: scan %d, router %d, static_router %d, expected %d\n", paths[k].c_str(), a, b, c, expected[k]);
+            return 1;
+        }
+    }
+
+    long sink = 0;
+    printf("%d routes, %zu paths (%zu misses), router built in %.2f ms\n",
+           ROUTES, paths.size(), std::size(misses), built.count());
+    double linear = measure(paths, iterations / 20 + 1, sink, [](const std::string& p) { return scan(p); });
+    double trie = measure(paths, iterations, sink, [&](const std::string& p) { return routes.find(0, p, m); });
+    double fixed = measure(paths, iterations, sink, [&](const std::string& p) {
+        return table::find(p, m) ? m.route : -1;
+    });
+    printf("%-14s %10.1f ns/path\n", "scan", linear);
+    printf("%-14s %10.1f ns/path\n", "router", trie);
+    printf("%-14s %10.1f ns/path\n", "static_router", fixed);
+    printf("(%ld)\n", sink);
+    return 0;
+}